@@ -5,10 +5,41 @@
 
 #include "SimpleDataProcess.h"
 
+#include <stdlib.h>
+
+// Record numbers and timestamps go past the 2^53 a double holds exactly
+static long long GetInteger(parser *p, const char *command, long long defvalue)
+{
+	const std::string value=p->GetValue(command,"");
+	return value.empty() ? defvalue : strtoll(value.c_str(),NULL,10);
+}
+
 Simple_Data_Process::Simple_Data_Process() {
 	config=false;
 	output_file="";
 	input_file="";
+	output_binary=false;
+	writer_ring_size=4096;
+	coincidence_file="NONE";
+	cpu_threads=0;
+	cpu_chunk=256;
+	pipeline_depth=2;
+	max_batch=16;
+	batch_latency=1000;
+	fixed_datapath=false;
+	wide_datapath=false;
+	stream_mode=false;
+	continuous_mode=false;
+	stream_ring_size=1024;
+	stream_records=0;
+	stream_poll=100;
+	stream_baseline=0;
+	stream_converters=1;
+	record_index=false;
+	record_from=0;
+	record_to=-1;
+	timestamp_from=-1;
+	timestamp_to=-1;
 	p=NULL;
 }
 
@@ -27,8 +58,39 @@ int Simple_Data_Process::configure(char* configfile)
 	if(!input_file.compare("NONE") || !output_file.compare("NONE"))
 		return PROC_BADCONFIG;
 
+	std::string format=p->GetValue("Output format","CSV");
+	output_binary=!format.compare("BINARY");
+	writer_ring_size=p->GetValue("Writer ring size",4096);
+	coincidence_file=p->GetValue("Coincidence file","NONE");
+
+	cpu_threads=p->GetValue("CPU threads",0);
+	cpu_chunk=p->GetValue("CPU chunk",256);
+
 	maxnsignals=p->GetValue("Max signals per frame",10);
 
+	pipeline_depth=p->GetValue("Pipeline depth",2);
+	max_batch=p->GetValue("Max batch",16);
+	batch_latency=p->GetValue("Batch latency",1000);
+
+	std::string datapath=p->GetValue("Datapath","FLOAT");
+	fixed_datapath=!datapath.compare("FIXED");
+	wide_datapath=!datapath.compare("WIDE");
+
+	std::string mode=p->GetValue("Acquisition mode","FILE");
+	continuous_mode=!mode.compare("CONTINUOUS");
+	stream_mode=!mode.compare("STREAM") || continuous_mode;
+	stream_ring_size=p->GetValue("Stream ring size",1024);
+	stream_records=p->GetValue("Stream records",0);
+	stream_poll=p->GetValue("Stream poll",100);
+	stream_baseline=p->GetValue("Stream baseline",0);
+	stream_converters=p->GetValue("Stream converters",1);
+
+	record_index=p->GetValue("Record index",0)>0;
+	record_from=GetInteger(p,"Record from",0);
+	record_to=GetInteger(p,"Record to",-1);
+	timestamp_from=GetInteger(p,"Timestamp from",-1);
+	timestamp_to=GetInteger(p,"Timestamp to",-1);
+
 
 	for(int i=0;i<MAX_SP_CHANNELS;i++)
     {
@@ -85,6 +147,9 @@ int Simple_Data_Process::configure(char* configfile)
 		CA[i].detection.signal_from=s_from;
 		CA[i].detection.signal_to=s_to;
 
+		std::string reject=channel+"reject saturated";
+		CA[i].reject_saturated=(p->GetValue(reject.data(),0)==1);
+
 		////////////////////////////////////////////////
 
 		for(int j=0;j<MAX_ENERGY_CALCULATIONS;j++)
@@ -112,6 +177,11 @@ int Simple_Data_Process::configure(char* configfile)
 			std::string Eshaping_type=p->GetValue(Eshaping.data(),"NONE");
 			CA[i].energy[j].use_shaping=SetFilter(energy,Eshaping_type,&CA[i].energy[j].shaping);
 		}
+
+		////////////////////////////////////////////////
+
+		std::string psd=channel+"psd ";
+		SetPSD(psd,&CA[i].psd,CA[i].energy);
     }
 
 	delete p;
@@ -123,6 +193,10 @@ bool Simple_Data_Process::SetFilter(std::string channel, std::string filtype, SI
 {
 	if(!filtype.compare("RC"))
 		shaping->shaping_algorithm=RC_SHAPING;
+	else if(!filtype.compare("RC_IIR"))
+		shaping->shaping_algorithm=RC_IIR_SHAPING;
+	else if(!filtype.compare("RC4"))
+		shaping->shaping_algorithm=RC4_SHAPING;
 	else
     {
 		shaping->shaping_algorithm=0;
@@ -139,6 +213,57 @@ bool Simple_Data_Process::SetFilter(std::string channel, std::string filtype, SI
 	return true;
 }
 
+bool Simple_Data_Process::SetPSD(std::string channel, DPSA_PSD_Struct *psd, const SIMPLE_Signal_Energy_Struct *ener)
+{
+	std::string tail=channel+"tail";
+	psd->tail=p->GetValue(tail.data(),-1);
+	std::string total=channel+"total";
+	psd->total=p->GetValue(total.data(),-1);
+
+	std::string keep=channel+"keep";
+	std::string keep_type=p->GetValue(keep.data(),"ALL");
+	if(!keep_type.compare("NEUTRON"))
+		psd->keep=PARTICLE_NEUTRON;
+	else if(!keep_type.compare("GAMMA"))
+		psd->keep=PARTICLE_GAMMA;
+	else
+		psd->keep=PARTICLE_NONE;
+
+	psd->active=false;
+	psd->points=0;
+	if(psd->tail<0 && psd->total<0)
+		return false;
+	if(psd->tail<0 || psd->tail>=MAX_ENERGY_CALCULATIONS || psd->total<0 || psd->total>=MAX_ENERGY_CALCULATIONS
+			|| !ener[psd->tail].active || !ener[psd->total].active)
+	{
+		fprintf(stderr,"\tWARNING: PSD needs active tail and total energies\n");
+		return false;
+	}
+
+	std::string points=channel+"cut points";
+	psd->points=p->GetValue(points.data(),0);
+	if(psd->points<1 || psd->points>MAX_PSD_POINTS)
+	{
+		fprintf(stderr,"\tWARNING: PSD cut needs 1 to %i points\n",MAX_PSD_POINTS);
+		psd->points=0;
+		return false;
+	}
+	std::string cut_energy=channel+"cut energy";
+	p->GetArray(cut_energy.data(),psd->points,psd->cut_energy);
+	std::string cut_ratio=channel+"cut ratio";
+	p->GetArray(cut_ratio.data(),psd->points,psd->cut_ratio);
+	for(int k=1;k<psd->points;k++)
+		if(psd->cut_energy[k]<=psd->cut_energy[k-1])
+		{
+			fprintf(stderr,"\tWARNING: PSD cut energies must increase\n");
+			psd->points=0;
+			return false;
+		}
+
+	psd->active=true;
+	return true;
+}
+
 bool Simple_Data_Process::SetCalcMethod(std::string calctype,SIMPLE_Signal_Energy_Struct *ener)
 {
 	if(!calctype.compare("AMPLITUDE"))
@@ -146,6 +271,10 @@ bool Simple_Data_Process::SetCalcMethod(std::string calctype,SIMPLE_Signal_Energ
 
 	else if(!calctype.compare("AREA"))
 		ener->calculation_method=AREA;
+	else if(!calctype.compare("RMS"))
+		ener->calculation_method=RMS;
+	else if(!calctype.compare("PEAK2PEAK"))
+		ener->calculation_method=PEAK2PEAK;
 	else
     {
 		ener->calculation_method=MAX_AMPLITUDE;
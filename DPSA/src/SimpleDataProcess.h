@@ -9,13 +9,14 @@
 #include <stdio.h>
 #include <string>
 #include "parser.h"
-#include "Simple_sp_devices_defines.h"
+#include "dpsa_defines.h"
 
 // Filters
 #define RC_SHAPING  0
 #define RC4_SHAPING 1
 #define MOV_AVERAGE 2
 #define TRAPEZOID   3
+#define RC_IIR_SHAPING 4 // One-pole recursive RC, RC4_SHAPING cascades four
 
 
 // Calculations
@@ -39,15 +40,36 @@ private:
 	parser *p;
 	bool SetFilter(std::string channel, std::string filttype,SIMPLE_Signal_Shaping_Struct *shaping);
 	bool SetCalcMethod(std::string calctype,SIMPLE_Signal_Energy_Struct *ener);
+	bool SetPSD(std::string channel, DPSA_PSD_Struct *psd, const SIMPLE_Signal_Energy_Struct *ener);
 	bool config;
 	int maxnsignals;
 public:
 	Simple_Data_Process();
 	virtual ~Simple_Data_Process();
 	int configure(char* configfile);
-	SIMPLE_Channel_Analysis_Struct CA[4];
+	DPSA_Channel_Analysis_Struct CA[4];
 	std::string output_file;
 	std::string input_file;
+	bool output_binary;  // Packed result_record/result_signal instead of CSV
+	int writer_ring_size; // Records queued for the writer thread
+	std::string coincidence_file; // Time ordered events of every channel, NONE without coincidences
+	int cpu_threads;    // CPU analysis without a device, 0 for every core
+	int cpu_chunk;      // Records per work item of the CPU threads
+	int pipeline_depth; // Batches in flight on the device
+	int max_batch;      // Records per kernel launch, upper bound
+	int batch_latency;  // Longest span of acquisition time in one batch [us]
+	bool fixed_datapath; // krnl_dpsa_fixed instead of krnl_dpsa
+	bool wide_datapath; // Eight samples per cycle: krnl_dpsa_wide from krnl_JESD204B_tx, the _wide stream kernels
+	bool stream_mode;   // Free-running acquisition from the ADC instead of File
+	bool continuous_mode; // Triggerless stream mode: krnl_dpsa_continuous, one result per pulse
+	int stream_ring_size;
+	int stream_records; // 0 runs forever
+	int stream_poll;    // [us]
+	int stream_baseline;// ADC units
+	int stream_converters; // Converters on one krnl_JESD204B_rx_stream, 1 for one rx per channel
+	bool record_index;  // Build or load the <File>.idx offset index
+	long long record_from, record_to;       // Record numbers [from, to), -1 for no limit
+	long long timestamp_from, timestamp_to; // Timestamps [from, to), -1 for no limit
 };
 
 #endif /* SRC_SIMPLEDATAPROCESS_H_ */
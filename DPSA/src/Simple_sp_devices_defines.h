@@ -120,7 +120,7 @@ struct SP_Devices_DataBlock_Information // Analysis version of the SIMPLE DAQ SP
 // Analysis Parameters **************************************
 struct SIMPLE_Signal_Shaping_Struct
 {
-  int shaping_algorithm; // Selects the integration algorithm. By default is 0 (RC). 1 for RC^4
+  int shaping_algorithm; // Selects the integration algorithm. By default is 0 (RC). 1 for RC^4, 4 for recursive RC
   float rc;
   float rc_scale;
 };
@@ -148,7 +148,7 @@ struct SIMPLE_Signal_Energy_Struct
   SIMPLE_Signal_Shaping_Struct shaping;
   int range_from;
   int range_to;
-  int calculation_method; // 0 - Amplitude: maximum or minimum (largest absolute), Area: range integral
+  int calculation_method; // 0 - Amplitude: maximum or minimum (largest absolute), Area: range integral, RMS: around the baseline, Peak2peak: max - min
   bool active;
   bool use_shaping;
   bool use_timing;
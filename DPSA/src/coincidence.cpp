@@ -0,0 +1,182 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#include "coincidence.h"
+
+#include <string.h>
+#include <unistd.h>
+
+static const size_t WRITE_BUFFER = 1 << 20;
+static const int BUILDER_POLL = 100; // Idle builder thread sleep [us]
+
+CoincidenceBuilder::CoincidenceBuilder(size_t ring_size, const SP_Devices_DataBlock_Information &card_header, unsigned int channels) :
+		channels(channels), merged(LLONG_MIN), header(), fp(NULL), format(OUTPUT_CSV), accepted(0), rejected(0), late(0)
+{
+	header.channels = channels;
+	header.tick = 1e9/card_header.i64Frequency;
+	for (int c = 0; c < MAX_SP_CHANNELS; c++) {
+		if (channels & (1u << c))
+			queues[c].reset(new channel_queue(ring_size));
+		// Sources beyond the channels (external trigger, sync) have no pulses here
+		trigger[c] = card_header.b_CoincidenceTrigger[c] != 0;
+		source[c] = trigger[c] ? card_header.iCoincidenceSource[c] & ((1u << MAX_SP_CHANNELS) - 1) : 0;
+		window[c] = trigger[c] ? card_header.iCoincidenceWindow[c] * (1LL << EVENT_TIME_FRACTION) : 0;
+		last[c] = 0;
+		seen[c] = false;
+		header.source[c] = source[c];
+		header.window[c] = trigger[c] ? card_header.iCoincidenceWindow[c] : 0;
+	}
+}
+
+CoincidenceBuilder::~CoincidenceBuilder() {
+	Close();
+}
+
+int CoincidenceBuilder::Open(std::string &filename, output_format format, const std::string &input_file)
+{
+	this->format = format;
+	fp = fopen(filename.c_str(), format == OUTPUT_CSV ? "w" : "wb");
+	if (!fp)
+		return -1;
+	setvbuf(fp, NULL, _IOFBF, WRITE_BUFFER);
+
+	if (format == OUTPUT_BINARY) {
+		memcpy(header.magic, COINCIDENCE_MAGIC, sizeof(header.magic));
+		header.version = COINCIDENCE_VERSION;
+		header.header_size = sizeof(coincidence_file_header);
+		header.event_size = sizeof(coincidence_event);
+		header.fraction_bits = EVENT_TIME_FRACTION;
+		strncpy(header.input_file, input_file.c_str(), sizeof(header.input_file) - 1);
+		fwrite(&header, sizeof(header), 1, fp);
+	}
+
+	builder = std::thread(&CoincidenceBuilder::Run, this);
+	return 0;
+}
+
+void CoincidenceBuilder::Push(int channel, const result_block &block)
+{
+	channel_queue & q = *queues[channel];
+	const int npeaks = block.data[NPEAKS];
+	for (int peak = 0; peak < npeaks; peak++) {
+		coincidence_event * event;
+		while ((event = q.ring.Claim()) == NULL) {
+			q.stalled.store(true, std::memory_order_release);
+			std::this_thread::yield();
+		}
+		q.stalled.store(false, std::memory_order_relaxed);
+
+		const float * r = block.data + peak*RESULT_FIELDS;
+		event->time = block.time[peak];
+		event->nrecord = block.index;
+		event->channel = channel;
+		event->nsignal = peak + 1;
+		event->sources = 0;
+		for (int i = ENERGY; i < PSD; i++)
+			event->energy[i - ENERGY] = r[i];
+		event->psd = r[PSD];
+		event->particle = r[PARTICLE];
+		q.ring.Publish();
+	}
+	// Later records start no earlier, and neither do their pulses
+	q.watermark.store((block.timestamp + block.recordstart) * (1LL << EVENT_TIME_FRACTION), std::memory_order_release);
+}
+
+void CoincidenceBuilder::Finish(int channel)
+{
+	queues[channel]->finished.store(true, std::memory_order_release);
+}
+
+// Sets the sources in the window before the event and tells whether it is kept
+bool CoincidenceBuilder::Match(coincidence_event &event)
+{
+	const int c = event.channel;
+	// A pulse let out of order is not matched against the later source pulses already seen
+	if (event.time < merged)
+		late++;
+	else
+		merged = event.time;
+	for (int s = 0; s < MAX_SP_CHANNELS; s++)
+		if ((source[c] & (1u << s)) && seen[s] && event.time >= last[s] && event.time - last[s] <= window[c])
+			event.sources |= 1u << s;
+	if (!seen[c] || event.time > last[c])
+		last[c] = event.time;
+	seen[c] = true;
+	return !trigger[c] || event.sources != 0;
+}
+
+void CoincidenceBuilder::Format(const coincidence_event &event)
+{
+	if (format == OUTPUT_BINARY) {
+		fwrite(&event, sizeof(event), 1, fp);
+		return;
+	}
+	fprintf(fp, "%lld,%u,%u,%u,%u,", event.time, event.channel, event.nrecord, event.nsignal, event.sources);
+	for (int i = 0; i < MAX_ENERGY_CALCULATIONS; i++)
+		fprintf(fp, "%g,", event.energy[i]);
+	fprintf(fp, "%g,%d\n", event.psd, event.particle);
+}
+
+void CoincidenceBuilder::Run()
+{
+	coincidence_event * head[MAX_SP_CHANNELS];
+	for (;;) {
+		// finished is read before the ring, so a finished channel with nothing queued is done
+		bool done = true;
+		int next = -1;
+		for (int c = 0; c < MAX_SP_CHANNELS; c++) {
+			head[c] = NULL;
+			if (!queues[c])
+				continue;
+			const bool finished = queues[c]->finished.load(std::memory_order_acquire);
+			if (queues[c]->ring.Peek(head[c]) == 0)
+				head[c] = NULL;
+			done = done && finished && !head[c];
+			if (head[c] && (next < 0 || head[c]->time < head[next]->time))
+				next = c;
+		}
+		if (next < 0) {
+			if (done)
+				break;
+			fflush(fp);
+			usleep(BUILDER_POLL);
+			continue;
+		}
+
+		// The earliest pulse leaves once no channel can still queue an earlier one,
+		// or when a writer thread waits for room
+		bool ready = true, stalled = false;
+		for (int c = 0; c < MAX_SP_CHANNELS; c++) {
+			if (!queues[c])
+				continue;
+			stalled = stalled || queues[c]->stalled.load(std::memory_order_acquire);
+			if (!head[c] && !queues[c]->finished.load(std::memory_order_acquire) &&
+					queues[c]->watermark.load(std::memory_order_acquire) < head[next]->time)
+				ready = false;
+		}
+		if (!ready && !stalled) {
+			usleep(BUILDER_POLL);
+			continue;
+		}
+
+		if (Match(*head[next])) {
+			Format(*head[next]);
+			accepted++;
+		} else {
+			rejected++;
+		}
+		queues[next]->ring.Release(1);
+	}
+	fflush(fp);
+}
+
+void CoincidenceBuilder::Close()
+{
+	if (builder.joinable())
+		builder.join();
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+}
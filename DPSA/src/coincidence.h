@@ -0,0 +1,117 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#ifndef COINCIDENCE_H_
+#define COINCIDENCE_H_
+
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+#include "result_writer.h"
+
+// One pulse of the merged stream, in physical units
+struct coincidence_event
+{
+    long long time;             // Absolute event time, as event_time of result_signal
+    uint32_t nrecord;
+    uint16_t channel;
+    uint16_t nsignal;
+    uint32_t sources;           // Coincidence sources with a pulse in the window before this one
+    float energy[MAX_ENERGY_CALCULATIONS];
+    float psd;
+    int particle;
+};
+
+static const char COINCIDENCE_MAGIC[8] = {'D','P','S','A','C','O','I','\0'};
+static const unsigned int COINCIDENCE_VERSION = 1;
+
+// Binary coincidence file: one coincidence_file_header, then the accepted coincidence_event
+struct coincidence_file_header
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int header_size;
+    unsigned int event_size;    // sizeof(coincidence_event)
+    unsigned int fraction_bits; // EVENT_TIME_FRACTION
+    float tick;                 // Sample clock period [ns]
+    unsigned int channels;      // Bitmask of the merged channels
+    int source[MAX_SP_CHANNELS];    // iCoincidenceSource of channels with a coincidence trigger, 0 otherwise
+    int window[MAX_SP_CHANNELS];    // iCoincidenceWindow [samples]
+    char input_file[192];
+};
+
+/*
+ * Coincidence stage. The writer thread of every channel pushes its pulses,
+ * in time order, into a bounded ring of that channel; a builder thread
+ * merges the rings by event time and applies the coincidence settings of the
+ * card in the same pass. A pulse of a channel with b_CoincidenceTrigger is
+ * kept when a channel of its iCoincidenceSource had a pulse at most
+ * iCoincidenceWindow samples before it; the pulses of other channels are all
+ * kept. Only the last pulse of every channel is remembered.
+ *
+ * A ring holds back the next pulse until every other channel has either a
+ * pulse queued or has moved past it. A channel that stays behind for longer
+ * than a full ring, e.g. one with no records, is skipped over instead of
+ * blocking the others, so its late pulses leave out of order. A late pulse
+ * only matches source pulses before it, and is counted.
+ */
+class CoincidenceBuilder
+{
+public:
+    // channels is the bitmask of the channels that push; ring_size pulses are queued per channel
+    CoincidenceBuilder(size_t ring_size, const SP_Devices_DataBlock_Information &card_header, unsigned int channels);
+    virtual ~CoincidenceBuilder();
+
+    int Open(std::string &filename, output_format format, const std::string &input_file);
+
+    // Writer threads: the pulses of one converted record, waiting while the ring is full
+    void Push(int channel, const result_block &block);
+    // No more records of the channel
+    void Finish(int channel);
+
+    // Waits until every channel has finished and the last pulse is written
+    void Close();
+
+    unsigned long long Accepted() const { return accepted; }
+    unsigned long long Rejected() const { return rejected; }
+    // Pulses that left after a later one, see above
+    unsigned long long Late() const { return late; }
+private:
+    struct channel_queue {
+        explicit channel_queue(size_t ring_size) : ring(ring_size), watermark(LLONG_MIN), stalled(false), finished(false) {}
+        SpscRing<coincidence_event> ring;
+        std::atomic<long long> watermark;   // No later pulse of the channel is earlier
+        std::atomic<bool> stalled;          // The writer thread waits for room
+        std::atomic<bool> finished;
+    };
+
+    void Run();
+    bool Match(coincidence_event &event);
+    void Format(const coincidence_event &event);
+
+    unsigned int channels;
+    std::unique_ptr<channel_queue> queues[MAX_SP_CHANNELS];
+    bool trigger[MAX_SP_CHANNELS];
+    unsigned int source[MAX_SP_CHANNELS];
+    long long window[MAX_SP_CHANNELS];  // Fixed point, as the event times
+    long long last[MAX_SP_CHANNELS];
+    bool seen[MAX_SP_CHANNELS];
+    long long merged;                   // Latest event time let out
+    coincidence_file_header header;
+
+    FILE *fp;
+    output_format format;
+    std::thread builder;
+    unsigned long long accepted;
+    unsigned long long rejected;
+    unsigned long long late;
+};
+
+#endif /* COINCIDENCE_H_ */
@@ -0,0 +1,565 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#include "cpu_engine.h"
+#include "SimpleDataProcess.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Must match krnl_dpsa.cpp
+#define MAX_PEAKS 10
+#define IIR_STAGES 4
+#define SPLINE_STEPS 3
+#ifndef ADC_RAIL_HIGH
+#define ADC_RAIL_HIGH 32767
+#endif
+#ifndef ADC_RAIL_LOW
+#define ADC_RAIL_LOW -32768
+#endif
+
+static constexpr int pow2_above(int n, int p = 1) { return p > n ? p : pow2_above(n, 2*p); }
+static constexpr int round_up8(int n) { return (n + 7) & ~7; }
+
+// Analysis parameters, as dpsa_params of krnl_dpsa.cpp
+template <int SIZE_, int RANGE_FROM_, int RANGE_TO_, int DELAY_, int SLOPE_, int SPLINE_, int REJECT_>
+struct cpu_params
+{
+	static constexpr int SIZE = SIZE_;
+	static constexpr int RANGE_FROM = RANGE_FROM_;
+	static constexpr int RANGE_TO = RANGE_TO_;
+	static constexpr int DELAY = DELAY_;
+	static constexpr int SLOPE = SLOPE_;
+	static constexpr bool SPLINE = SPLINE_ != 0;
+	static constexpr bool REJECT = REJECT_ != 0;
+
+	// Analysis window of a trigger: baseline, pulse, baseline
+	static constexpr int WINDOW = 3*SIZE;
+	static constexpr int TRIGGER_LAG = SIZE + RANGE_FROM;
+	// Shaped lengths, multiples of 8 so the vector loops have no remainder
+	static constexpr int CFD_N = round_up8(WINDOW);
+	static constexpr int RC_N = round_up8(CFD_N + DELAY);
+	// Zeros around the record: the first window starts TRIGGER_LAG before it, its energy range up to RANGE_FROM
+	// earlier and the FIR reads CPU_FIR_N more; the shaped window and the last energy range end after it
+	static constexpr int LEAD = pow2_above(TRIGGER_LAG + RANGE_FROM + CPU_FIR_N);
+	static constexpr int TAIL = pow2_above((RC_N > WINDOW - 1 + RANGE_TO ? RC_N : WINDOW - 1 + RANGE_TO) - TRIGGER_LAG);
+
+	// Those of dpsa_params: the engine takes no parameters the kernels cannot
+	static_assert(RANGE_FROM >= 0 && RANGE_TO > 0, "empty energy range");
+	static_assert(RANGE_TO <= WINDOW - 3, "energy range overlaps the range of the pulse after next");
+	static_assert(SLOPE == 1 || SLOPE == -1, "SLOPE is the pulse polarity");
+	static_assert(DELAY > 0 && DELAY < WINDOW, "DELAY outside the window");
+};
+
+#ifdef DPSA_CONFIG
+#include "dpsa_config.h"
+#else
+#define DPSA_PARAMS 350, 50, 300, 10, -1, 1, 0
+#endif
+typedef cpu_params<DPSA_PARAMS> cpu_config;
+
+// True where v is past th in the direction of the pulses
+template <class P>
+static bool beyond(float v, float th)
+{
+	return P::SLOPE < 0 ? v < th : v > th;
+}
+
+/* Vector primitives */
+
+// y[n] = sum(x[n-i]*h[i]) / h_sum, accumulated in the kernel order
+static void fir(const float * x, const float * h, float h_sum, float * y, int n)
+{
+#if defined(__AVX2__)
+	const __m256 vsum = _mm256_set1_ps(h_sum);
+	for (int k = 0; k < n; k += 8) {
+		__m256 acc = _mm256_setzero_ps();
+		for (int i = 0; i < CPU_FIR_N; i++)
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + k - i), _mm256_set1_ps(h[i])));
+		_mm256_storeu_ps(y + k, _mm256_div_ps(acc, vsum));
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (int k = 0; k < n; k += 4) {
+		float32x4_t acc = vdupq_n_f32(0);
+		for (int i = 0; i < CPU_FIR_N; i++)
+			acc = vaddq_f32(acc, vmulq_n_f32(vld1q_f32(x + k - i), h[i]));
+		vst1q_f32(y + k, vdivq_f32(acc, vdupq_n_f32(h_sum)));
+	}
+#else
+	for (int k = 0; k < n; k++) {
+		float acc = 0;
+		for (int i = 0; i < CPU_FIR_N; i++)
+			acc += x[k - i]*h[i];
+		y[k] = acc/h_sum;
+	}
+#endif
+}
+
+// y[n] = a*x[n] + b*y[n-1] for each of stages poles in cascade, from rest
+static void iir(const float * x, float a, float b, int stages, float * y, int n)
+{
+	float state[IIR_STAGES] = {0, 0, 0, 0};
+	for (int k = 0; k < n; k++) {
+		float v = x[k];
+		for (int s = 0; s < stages; s++) {
+			state[s] = a*v + b*state[s];
+			v = state[s];
+		}
+		y[k] = v;
+	}
+}
+
+// rc[n] = (s[n] - baseline)*scale
+static void rc_calc(const float * s, float baseline, float scale, float * rc, int n)
+{
+	for (int k = 0; k < n; k++)
+		rc[k] = (s[k] - baseline)*scale;
+}
+
+// cfd[n] = rc[n] - factor*rc[n+DELAY]
+template <class P>
+static void cfd_calc(const float * rc, float factor, float * cfd, int n)
+{
+#if defined(__AVX2__)
+	const __m256 vfactor = _mm256_set1_ps(factor);
+	for (int k = 0; k < n; k += 8)
+		_mm256_storeu_ps(cfd + k, _mm256_sub_ps(_mm256_loadu_ps(rc + k), _mm256_mul_ps(vfactor, _mm256_loadu_ps(rc + k + P::DELAY))));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (int k = 0; k < n; k += 4)
+		vst1q_f32(cfd + k, vsubq_f32(vld1q_f32(rc + k), vmulq_n_f32(vld1q_f32(rc + k + P::DELAY), factor)));
+#else
+	for (int k = 0; k < n; k++)
+		cfd[k] = rc[k] - factor*rc[k + P::DELAY];
+#endif
+}
+
+// First index in [from, to) where x is beyond th (below == true) or not beyond th, to if none
+template <class P>
+static int search(const float * x, int from, int to, float th, bool below)
+{
+	int k = from;
+#if defined(__AVX2__)
+	const __m256 vth = _mm256_set1_ps(th);
+	for (; k + 8 <= to; k += 8) {
+		const __m256 v = _mm256_loadu_ps(x + k);
+		const __m256 m = P::SLOPE < 0 ?
+				(below ? _mm256_cmp_ps(v, vth, _CMP_LT_OQ) : _mm256_cmp_ps(v, vth, _CMP_NLT_UQ)) :
+				(below ? _mm256_cmp_ps(v, vth, _CMP_GT_OQ) : _mm256_cmp_ps(v, vth, _CMP_NGT_UQ));
+		const int mask = _mm256_movemask_ps(m);
+		if (mask)
+			return k + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const float32x4_t vth = vdupq_n_f32(th);
+	for (; k + 4 <= to; k += 4) {
+		uint32x4_t m = P::SLOPE < 0 ? vcltq_f32(vld1q_f32(x + k), vth) : vcgtq_f32(vld1q_f32(x + k), vth);
+		if (!below)
+			m = vmvnq_u32(m);
+		if (vmaxvq_u32(m))
+			break;
+	}
+#endif
+	for (; k < to; k++)
+		if (beyond<P>(x[k], th) == below)
+			return k;
+	return to;
+}
+
+// Last index in [from, to) where x is beyond th (below == true) or not beyond th, from - 1 if none
+template <class P>
+static int rsearch(const float * x, int from, int to, float th, bool below)
+{
+	int k = to;
+#if defined(__AVX2__)
+	const __m256 vth = _mm256_set1_ps(th);
+	for (; k - 8 >= from; k -= 8) {
+		const __m256 v = _mm256_loadu_ps(x + k - 8);
+		const __m256 m = P::SLOPE < 0 ?
+				(below ? _mm256_cmp_ps(v, vth, _CMP_LT_OQ) : _mm256_cmp_ps(v, vth, _CMP_NLT_UQ)) :
+				(below ? _mm256_cmp_ps(v, vth, _CMP_GT_OQ) : _mm256_cmp_ps(v, vth, _CMP_NGT_UQ));
+		const int mask = _mm256_movemask_ps(m);
+		if (mask)
+			return k - 8 + 31 - __builtin_clz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const float32x4_t vth = vdupq_n_f32(th);
+	for (; k - 4 >= from; k -= 4) {
+		uint32x4_t m = P::SLOPE < 0 ? vcltq_f32(vld1q_f32(x + k - 4), vth) : vcgtq_f32(vld1q_f32(x + k - 4), vth);
+		if (!below)
+			m = vmvnq_u32(m);
+		if (vmaxvq_u32(m))
+			break;
+	}
+#endif
+	for (; k > from; k--)
+		if (beyond<P>(x[k - 1], th) == below)
+			return k - 1;
+	return from - 1;
+}
+
+/* Algorithm, as the krnl_dpsa stages compute it */
+
+// Zero of the cubic through y0..y3 at -1, 0, 1 and 2, between y1 and y2: the kernel cfd_spline
+static float cfd_spline(float y0, float y1, float y2, float y3)
+{
+	const float c0 = y1;
+	const float c1 = -y0/3 - y1/2 + y2 - y3/6;
+	const float c2 = y0/2 - y1 + y2/2;
+	const float c3 = (y3 - y0)/6 + (y1 - y2)/2;
+	float x = -y1/(y2-y1);
+	for (int i = 0; i < SPLINE_STEPS; i++) {
+		const float f = c0 + x*(c1 + x*(c2 + x*c3));
+		const float df = c1 + x*(2*c2 + 3*x*c3);
+		x = df != 0 ? x - f/df : x;
+		x = x < 0 ? 0.0f : x > 1 ? 1.0f : x;
+	}
+	return x;
+}
+
+// Start of the window of every trigger: the kernel load_input
+template <class P>
+static short load_input(const float * l_in, int size, float threshold, int * start_index)
+{
+	short npeaks = 0;
+	int i = 0;
+	while (npeaks < MAX_PEAKS) {
+		i = search<P>(l_in, i, size, threshold, true);
+		if (i == size)
+			break;
+		start_index[npeaks++] = i - P::TRIGGER_LAG;
+		// The trigger is re-armed once the window has been read
+		i += P::WINDOW + 2;
+	}
+	return npeaks;
+}
+
+// Prefix sums of the record: the sum of x[a..b] is p[b] - p[a - 1]
+static void prefix_sums(const float * x, int64_t * p, int64_t * p2, int n)
+{
+	int64_t s = 0;
+	int64_t s2 = 0;
+	for (int i = 0; i < n; i++) {
+		const int64_t v = x[i];
+		s += v;
+		s2 += v*v;
+		p[i] = s;
+		p2[i] = s2;
+	}
+}
+
+// p and p2 point at the prefix sums of the window start, pulse in [SIZE, 2*SIZE]
+template <class P>
+static void baseline_calc(float & baseline, float & stdbaseline, const int64_t * p, const int64_t * p2)
+{
+	const int total = P::SIZE;
+	int64_t s_left = p[P::SIZE - 1] - p[-1];
+	int64_t s_right = p[P::WINDOW] - p[2*P::SIZE];
+	int64_t s2_left = p2[P::SIZE - 1] - p2[-1];
+	int64_t s2_right = p2[P::WINDOW] - p2[2*P::SIZE];
+
+	float l_baseline = float(s_left + s_right)/(2*total);
+	float l_stdbaseline = sqrtf(float(s2_left + s2_right)/(2*total) - l_baseline*l_baseline);
+
+	s2_left *= total;
+	s2_left -= s_left*s_left;
+
+	s2_right *= total;
+	s2_right -= s_right*s_right;
+
+	float var_left = sqrtf(float(s2_left))/total;
+	float var_right = sqrtf(float(s2_right))/total;
+	float baseline_left = float(s_left) / total;
+	float baseline_right = float(s_right) / total;
+
+	if (var_left < var_right) {
+		if (fabsf(baseline_right - baseline_left) < 3 * var_left) {
+			baseline = l_baseline;
+			stdbaseline = l_stdbaseline;
+		}
+		else {
+			baseline = baseline_left;
+			stdbaseline = var_left;
+		}
+	}
+	else {
+		if (fabsf(baseline_right - baseline_left) < 3 * var_right) {
+			baseline = l_baseline;
+			stdbaseline = l_stdbaseline;
+		}
+		else {
+			baseline = baseline_right;
+			stdbaseline = var_right;
+		}
+	}
+}
+
+// The whole record is shaped once; both filters have unit gain, so each window then subtracts its baseline
+static void shape_signal(const float * x, const float * h, float h_sum, float * shaped, int n, int shaping)
+{
+	if (shaping == RC_SHAPING)
+		fir(x + CPU_FIR_N, h, h_sum, shaped + CPU_FIR_N, (n - CPU_FIR_N) & ~7);
+	else
+		iir(x, h[0], h[1], shaping == RC4_SHAPING ? IIR_STAGES : 1, shaped, n);
+}
+
+template <class P>
+static void compute_rc_cfd(const float * shaped, float baseline, float * rc_vector, float * cfd_vector, float factor, float scale)
+{
+	rc_calc(shaped, baseline, scale, rc_vector, P::RC_N);
+	cfd_calc<P>(rc_vector, factor, cfd_vector, P::CFD_N);
+}
+
+// Returns whether there is a pulse; from is the start of the RANGE_FROM + RANGE_TO samples around the last one, relative to the window
+template <class P>
+static bool peak_detection(short & pileup, float & time, int & from, const float * rc_vector, const float * cfd_vector, int start_index, float threshold)
+{
+	unsigned int index[MAX_PEAKS + 1] = {0};
+	short numberpulses = 0;
+
+	// A pulse starts wherever the shaped signal goes beyond threshold
+	int i = 0;
+	while (numberpulses < MAX_PEAKS) {
+		i = search<P>(rc_vector, i, P::WINDOW, threshold, true);
+		if (i == P::WINDOW)
+			break;
+
+		index[numberpulses] = i;
+		++numberpulses;
+
+		if (numberpulses >= 2) {
+			if ((index[numberpulses - 1] - index[numberpulses - 2]) <= P::SIZE) {
+				//PILEUP LEFT
+				--numberpulses;
+				pileup |= 2;
+			}
+			if (numberpulses >= 2 && (index[numberpulses] - index[numberpulses - 1]) <= P::SIZE) {
+				//PILEUP RIGHT
+				--numberpulses;
+				pileup |= 1;
+			}
+		} else {
+			pileup = 0;
+		}
+
+		i = search<P>(rc_vector, i, P::WINDOW, threshold, false);
+	}
+
+	// The crossing is the last non negative CFD sample before a negative pulse, or the one before the
+	// next negative sample; as in the kernel, the spline needs a sample on each side inside the window
+	for (int pulse = 0; pulse < numberpulses; pulse++) {
+		int idx = index[pulse];
+		if (beyond<P>(cfd_vector[idx], 0))
+			idx = std::max(rsearch<P>(cfd_vector, 0, idx, 0, false), 0);
+		else
+			idx = search<P>(cfd_vector, idx, P::WINDOW - 1, 0, true) - 1;
+		float zero_cross;
+		if (P::SPLINE && idx >= 1 && idx <= P::WINDOW - 3) {
+			zero_cross = idx + cfd_spline(cfd_vector[idx - 1], cfd_vector[idx], cfd_vector[idx + 1], cfd_vector[idx + 2]);
+		} else {
+			// X = -b(x2-x1)/(y2-y1) = -Y/(y2-y1) = -y1/(y2-y1)
+			zero_cross = idx - (cfd_vector[idx])/(cfd_vector[idx + 1] - cfd_vector[idx]);
+		}
+
+		time = zero_cross + start_index;
+		from = idx - P::RANGE_FROM;
+	}
+	return numberpulses >= 1;
+}
+
+// x, p and p2 point at the start of the energy range; sums over a window are differences of prefix sums
+template <class P>
+static float energy_calculation(int method, int from, int to, const float * x, const int64_t * p, const int64_t * p2, float baseline)
+{
+	const int count = to - from + 1;
+	const int64_t s1 = p[to] - p[from - 1];
+	const int64_t s2 = p2[to] - p2[from - 1];
+
+	if (method == MAX_AMPLITUDE) {
+		// MAX VALUE, the largest excursion in the direction of the pulses
+		float ext = x[from];
+		for (int i = from + 1; i <= to; i++)
+			ext = beyond<P>(x[i], ext) ? x[i] : ext;
+		const float ampli = ext - baseline;
+		return P::SLOPE*(beyond<P>(ampli, 0) ? ampli : 0.0f);
+	}
+	if (method == AREA)
+		return P::SLOPE*(float(s1) - count*baseline);
+	if (method == RMS) {
+		const float mean = float(s1)/count;
+		const float square = float(s2)/count - 2*baseline*mean + baseline*baseline;
+		return square > 0 ? sqrtf(square) : 0.0f;
+	}
+	if (method == PEAK2PEAK) {
+		float hi = x[from], lo = x[from];
+		for (int i = from + 1; i <= to; i++) {
+			hi = x[i] > hi ? x[i] : hi;
+			lo = x[i] < lo ? x[i] : lo;
+		}
+		return hi - lo;
+	}
+	return 0;
+}
+
+// Tail/total ratio and particle of a pulse: the kernel psd_classify
+static void psd_classify(int points, const float * energy, const float * ratio_cut, const float * slope, float tail, float total, float & ratio, int & particle)
+{
+	ratio = points > 0 && total > 0 ? tail/total : 0.0f;
+	int seg = -1;
+	for (int k = 0; k < points; k++)
+		if (total >= energy[k])
+			seg = k;
+	particle = PARTICLE_NONE;
+	if (seg >= 0) {
+		const float cut = ratio_cut[seg] + slope[seg]*(total - energy[seg]);
+		particle = ratio > cut ? PARTICLE_NEUTRON : PARTICLE_GAMMA;
+	}
+}
+
+CpuEngine::CpuEngine(const float *h, float factor, float threshold, float scale, int shaping, const int *windows, const float *psd) :
+		h_sum(0), factor(factor), threshold(threshold), scale(scale), shaping(shaping),
+		rc(cpu_config::RC_N), cfd(cpu_config::CFD_N) {
+	for (int i = 0; i < CPU_FIR_N; i++) {
+		this->h[i] = h[i];
+		h_sum += h[i];
+	}
+	// As the kernel load_windows: from the zero crossing to the start of the energy range, clamped to it.
+	// std::min and std::max take references, so they get a copy of the range end
+	const int range_to = cpu_config::RANGE_TO;
+	for (int e = 0; e < MAX_ENERGY_CALCULATIONS; e++) {
+		const int m = windows[WINDOW_ARGS*e + WINDOW_METHOD];
+		from[e] = std::max(windows[WINDOW_ARGS*e + WINDOW_FROM] + cpu_config::RANGE_FROM, 0);
+		to[e] = std::min(windows[WINDOW_ARGS*e + WINDOW_TO] + cpu_config::RANGE_FROM, range_to);
+		method[e] = m >= MAX_AMPLITUDE && m <= PEAK2PEAK && from[e] <= to[e] ? m : NO_ENERGY;
+	}
+	// As the kernel load_psd
+	psd_tail = psd[PSD_TAIL];
+	psd_total = psd[PSD_TOTAL];
+	psd_points = psd[PSD_POINTS];
+	const bool valid = psd_tail >= 0 && psd_tail < MAX_ENERGY_CALCULATIONS && psd_total >= 0 && psd_total < MAX_ENERGY_CALCULATIONS &&
+			psd_points >= 1 && psd_points <= MAX_PSD_POINTS;
+	if (!valid) {
+		psd_tail = 0;
+		psd_total = 0;
+		psd_points = 0;
+	}
+	psd_keep = valid ? (int)psd[PSD_KEEP] : PARTICLE_NONE;
+	for (int k = 0; k < MAX_PSD_POINTS; k++) {
+		cut_energy[k] = psd[PSD_CUT_ENERGY + k];
+		cut_ratio[k] = psd[PSD_CUT_RATIO + k];
+	}
+	for (int k = 0; k < MAX_PSD_POINTS; k++)
+		cut_slope[k] = k + 1 < psd_points ? (cut_ratio[k + 1] - cut_ratio[k])/(cut_energy[k + 1] - cut_energy[k]) : 0.0f;
+}
+
+CpuEngine::CpuEngine(const channel_args &args) :
+		CpuEngine(args.h, args.factor, args.threshold, args.scale, args.shaping, args.windows, args.psd) {
+}
+
+CpuEngine::~CpuEngine() {
+}
+
+const char *CpuEngine::Isa()
+{
+#if defined(__AVX2__)
+	return "AVX2";
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	return "NEON";
+#else
+	return "scalar";
+#endif
+}
+
+void CpuEngine::Analyse(const int16_t *samples, int size, int baseline, float *result)
+{
+	typedef cpu_config P;
+	const int LEAD = P::LEAD;
+	const int TAIL = P::TAIL;
+
+	// The record between zeros, at the moving average outside it
+	const int n = LEAD + size + TAIL;
+	if ((int)l_in.size() < n) {
+		l_in.resize(n);
+		shaped.resize(n);
+		prefix.resize(n);
+		prefix2.resize(n);
+		clip_prefix.resize(n);
+	}
+	// Clipped samples are counted as the record is copied, as the kernel read_trigger does
+	float * x = l_in.data() + LEAD;
+	int * pc = clip_prefix.data() + LEAD;
+	int c = 0;
+	for (int i = -LEAD; i < 0; i++) {
+		x[i] = 0;
+		pc[i] = 0;
+	}
+	for (int i = 0; i < size; i++) {
+		x[i] = samples[i] - baseline;
+		c += samples[i] >= ADC_RAIL_HIGH || samples[i] <= ADC_RAIL_LOW;
+		pc[i] = c;
+	}
+	for (int i = size; i < size + TAIL; i++) {
+		x[i] = 0;
+		pc[i] = c;
+	}
+
+	int start_index[MAX_PEAKS];
+	const short npeaks = load_input<P>(x, size, threshold, start_index);
+
+	memset(result, 0, MAX_PEAKS*RESULT_FIELDS*sizeof(float));
+	if (npeaks == 0)
+		return;
+	shape_signal(l_in.data(), h, h_sum, shaped.data(), n, shaping);
+	prefix_sums(l_in.data(), prefix.data(), prefix2.data(), n);
+	const int64_t * px = prefix.data() + LEAD;
+	const int64_t * px2 = prefix2.data() + LEAD;
+
+	short kept = 0;
+	for (short p = 0; p < npeaks; p++) {
+		const int start = start_index[p];
+		const int clipped = pc[start + P::WINDOW] - pc[start - 1];
+		if (P::REJECT && clipped > 0)
+			continue;
+		float bl, stdbl;
+		baseline_calc<P>(bl, stdbl, px + start, px2 + start);
+
+		compute_rc_cfd<P>(shaped.data() + LEAD + start, bl, rc.data(), cfd.data(), factor, scale);
+
+		short pileup = 0;
+		float time = start_index[p] + P::TRIGGER_LAG;
+		float energy[MAX_ENERGY_CALCULATIONS] = {0};
+		float ratio = 0;
+		int particle = PARTICLE_NONE;
+		int range = 0;
+		if (peak_detection<P>(pileup, time, range, rc.data(), cfd.data(), start_index[p], threshold)) {
+			for (int e = 0; e < MAX_ENERGY_CALCULATIONS; e++)
+				energy[e] = energy_calculation<P>(method[e], from[e], to[e], x + start + range, px + start + range, px2 + start + range, bl);
+			psd_classify(psd_points, cut_energy, cut_ratio, cut_slope, energy[psd_tail], energy[psd_total], ratio, particle);
+		}
+		// When the PSD keeps one particle, pulses without energies are not classified and go too
+		if (psd_keep != PARTICLE_NONE && particle != psd_keep)
+			continue;
+
+		float * r = result + kept*RESULT_FIELDS;
+		r[PILEUP] = pileup;
+		r[SATURED] = clipped;
+		r[BASELINE] = bl;
+		r[STDBASELINE] = stdbl;
+		r[PTIME] = time;
+		for (int e = 0; e < MAX_ENERGY_CALCULATIONS; e++)
+			r[ENERGY + e] = energy[e];
+		r[PSD] = ratio;
+		r[PARTICLE] = particle;
+		kept++;
+	}
+	for (short p = 0; p < kept; p++)
+		result[p*RESULT_FIELDS + NPEAKS] = kept;
+}
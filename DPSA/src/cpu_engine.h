@@ -0,0 +1,81 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#ifndef CPU_ENGINE_H_
+#define CPU_ENGINE_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "result_writer.h"
+
+#define CPU_FIR_N 20
+
+// Run time arguments of krnl_dpsa for one channel, in kernel units
+struct channel_args
+{
+    float h[CPU_FIR_N];
+    float factor;
+    float threshold;
+    float scale;
+    int shaping;
+    int windows[MAX_ENERGY_CALCULATIONS*WINDOW_ARGS];
+    float psd[PSD_ARGS];
+};
+
+/*
+ * Host implementation of krnl_dpsa. The engine computes what the kernel
+ * stages compute, window by window instead of sample by sample: the record
+ * is shaped once, samples outside it sit at the record moving average, and
+ * every window subtracts its baseline from the shaped signal. Baseline and
+ * energy windows are differences of the record prefix sums. The FIR, CFD
+ * and threshold searches are vectorised with AVX2 or NEON when the compiler
+ * targets them; the recursive shaping modes are scalar.
+ */
+class CpuEngine
+{
+public:
+    // h holds the FIR taps for RC_SHAPING, or a and b of the pole for the recursive modes;
+    // windows and psd are the energy window and PSD tables of the kernels
+    CpuEngine(const float *h, float factor, float threshold, float scale, int shaping, const int *windows, const float *psd);
+    CpuEngine(const channel_args &args);
+    virtual ~CpuEngine();
+
+    // Analyses one record; result holds MAX_PEAKS x RESULT_FIELDS floats laid out as krnl_dpsa writes them
+    void Analyse(const int16_t *samples, int size, int baseline, float *result);
+
+    // Instruction set the engine was built for
+    static const char *Isa();
+private:
+    float h[CPU_FIR_N];
+    float h_sum;
+    float factor;
+    float threshold;
+    float scale;
+    int shaping;
+    // Energy windows in samples of the energy range, method NO_ENERGY when unused
+    int method[MAX_ENERGY_CALCULATIONS];
+    int from[MAX_ENERGY_CALCULATIONS];
+    int to[MAX_ENERGY_CALCULATIONS];
+    // PSD cut, no points without PSD; slope is to the next point
+    int psd_tail;
+    int psd_total;
+    int psd_keep;
+    int psd_points;
+    float cut_energy[MAX_PSD_POINTS];
+    float cut_ratio[MAX_PSD_POINTS];
+    float cut_slope[MAX_PSD_POINTS];
+
+    // Scratch buffers, sized once
+    std::vector<float> l_in;
+    std::vector<float> shaped;
+    std::vector<int64_t> prefix;
+    std::vector<int64_t> prefix2;
+    std::vector<int> clip_prefix;
+    std::vector<float> rc;
+    std::vector<float> cfd;
+};
+
+#endif /* CPU_ENGINE_H_ */
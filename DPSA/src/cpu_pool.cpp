@@ -0,0 +1,189 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#include "cpu_pool.h"
+
+#include <thread>
+
+// Chunks in flight per worker: bounds the reorder buffer memory
+static const int CHUNKS_PER_WORKER = 4;
+static const int RECORD_RESULTS = RESULT_MAX_PEAKS*RESULT_FIELDS;
+
+CpuPool::CpuPool(int nthreads, int chunk_size, const channel_args *args, uint32_t nsamples) :
+		nthreads(nthreads), chunk_size(chunk_size), nsamples(nsamples),
+		reader(NULL), record_index(NULL), writers(NULL), first(0), last(0), pending(0), stop(false) {
+	if (this->nthreads <= 0)
+		this->nthreads = std::thread::hardware_concurrency();
+	if (this->nthreads <= 0)
+		this->nthreads = 1;
+	if (this->chunk_size <= 0)
+		this->chunk_size = 1;
+	for (int i = 0; i < MAX_SP_CHANNELS; i++)
+		this->args[i] = args[i];
+}
+
+CpuPool::~CpuPool() {
+}
+
+int CpuPool::Threads() const
+{
+	return nthreads;
+}
+
+void CpuPool::Push(size_t c)
+{
+	chunk & ch = window[c % window.size()];
+	ch.first = first + c*chunk_size;
+	ch.count = std::min((size_t) chunk_size, last - ch.first);
+	ch.ready = false;
+
+	// Counted before it can be taken, so pending never drops below the queued chunks
+	{
+		std::lock_guard<std::mutex> lock(m);
+		pending++;
+	}
+	worker_queue & q = queues[c % nthreads];
+	{
+		std::lock_guard<std::mutex> lock(q.m);
+		q.chunks.push_back(c);
+	}
+	work_cv.notify_one();
+}
+
+bool CpuPool::Take(int id, size_t &c)
+{
+	// Own chunks, oldest first
+	{
+		worker_queue & q = queues[id];
+		std::lock_guard<std::mutex> lock(q.m);
+		if (!q.chunks.empty()) {
+			c = q.chunks.front();
+			q.chunks.pop_front();
+			pending--;
+			return true;
+		}
+	}
+	// Steal the newest chunk of another worker
+	for (int i = 1; i < nthreads; i++) {
+		worker_queue & q = queues[(id + i) % nthreads];
+		std::lock_guard<std::mutex> lock(q.m);
+		if (!q.chunks.empty()) {
+			c = q.chunks.back();
+			q.chunks.pop_back();
+			pending--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void CpuPool::Analyse(std::unique_ptr<CpuEngine> *engines, std::vector<int16_t> &samples, chunk &ch)
+{
+	for (size_t r = 0; r < ch.count; r++) {
+		float * result = ch.results.data() + r*RECORD_RESULTS;
+		record_view record;
+		ch.channel[r] = -1;
+		if (reader->RecordAt((*record_index)[ch.first + r].offset, record) != NO_ERROR)
+			continue;
+		const int channel = record.header->channel;
+		if (channel < 0 || channel >= MAX_SP_CHANNELS || !engines[channel])
+			continue;
+		MappedReader::CopySamples(record, samples.data(), nsamples);
+		engines[channel]->Analyse(samples.data(), nsamples, record.header->moving_average, result);
+		ch.baseline[r] = record.header->moving_average;
+		ch.timestamp[r] = record.header->timestamp;
+		ch.recordstart[r] = record.header->recordstart;
+		ch.channel[r] = channel;
+	}
+}
+
+void CpuPool::Work(int id)
+{
+	std::unique_ptr<CpuEngine> engines[MAX_SP_CHANNELS];
+	for (int i = 0; i < MAX_SP_CHANNELS; i++)
+		if (writers[i])
+			engines[i].reset(new CpuEngine(args[i]));
+	std::vector<int16_t> samples(nsamples);
+
+	for (;;) {
+		size_t c;
+		if (!Take(id, c)) {
+			std::unique_lock<std::mutex> lock(m);
+			work_cv.wait(lock, [this] { return stop || pending > 0; });
+			if (stop)
+				return;
+			continue;
+		}
+
+		chunk & ch = window[c % window.size()];
+		Analyse(engines, samples, ch);
+		{
+			std::lock_guard<std::mutex> lock(m);
+			ch.ready = true;
+		}
+		done_cv.notify_all();
+	}
+}
+
+size_t CpuPool::Run(const MappedReader &reader, const RecordIndex &record_index, size_t first, size_t last, ResultWriter * const *writers)
+{
+	if (last <= first)
+		return 0;
+
+	this->reader = &reader;
+	this->record_index = &record_index;
+	this->writers = writers;
+	this->first = first;
+	this->last = last;
+	stop = false;
+	pending = 0;
+
+	const size_t nchunks = (last - first + chunk_size - 1) / chunk_size;
+	window = std::vector<chunk>(std::min(nchunks, (size_t) nthreads*CHUNKS_PER_WORKER));
+	for (chunk & ch : window) {
+		ch.results.resize(chunk_size*RECORD_RESULTS);
+		ch.baseline.resize(chunk_size);
+		ch.timestamp.resize(chunk_size);
+		ch.recordstart.resize(chunk_size);
+		ch.channel.resize(chunk_size);
+	}
+	queues.reset(new worker_queue[nthreads]);
+
+	for (size_t c = 0; c < window.size(); c++)
+		Push(c);
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < nthreads; i++)
+		workers.push_back(std::thread(&CpuPool::Work, this, i));
+
+	// Reorder buffer: chunks leave in record order, each freed slot takes the next chunk
+	size_t skipped = 0;
+	for (size_t c = 0; c < nchunks; c++) {
+		chunk & ch = window[c % window.size()];
+		{
+			std::unique_lock<std::mutex> lock(m);
+			done_cv.wait(lock, [&ch] { return ch.ready; });
+		}
+		for (size_t r = 0; r < ch.count; r++) {
+			if (ch.channel[r] < 0) {
+				skipped++;
+				continue;
+			}
+			const int baseline[2] = {ch.baseline[r], 0};
+			writers[ch.channel[r]]->Write(ch.results.data() + r*RECORD_RESULTS, baseline, ch.first + r + 1, ch.timestamp[r], ch.recordstart[r]);
+		}
+		if (c + window.size() < nchunks)
+			Push(c + window.size());
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m);
+		stop = true;
+	}
+	work_cv.notify_all();
+	for (std::thread & t : workers)
+		t.join();
+	return skipped;
+}
@@ -0,0 +1,85 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#ifndef CPU_POOL_H_
+#define CPU_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "cpu_engine.h"
+#include "reader.h"
+#include "record_index.h"
+#include "result_writer.h"
+
+/*
+ * Multi-threaded CPU analysis. The records are cut into chunks that are
+ * dealt round-robin to per-worker deques; a worker takes its own chunks
+ * from the front and, once idle, steals from the back of the others, so
+ * pileup-heavy stretches of the file do not leave cores waiting. Only a
+ * window of chunks is in flight: the calling thread emits them in record
+ * order through a reorder buffer, so the output is the same as with one
+ * thread. Every record is analysed with the settings of its channel and
+ * written to the writer of that channel.
+ */
+class CpuPool
+{
+public:
+    // nthreads 0 uses every hardware thread; args holds MAX_SP_CHANNELS channels
+    CpuPool(int nthreads, int chunk_size, const channel_args *args, uint32_t nsamples);
+    virtual ~CpuPool();
+
+    // Analyses records [first, last) of the index and writes them in order. writers holds
+    // MAX_SP_CHANNELS writers, NULL for inactive channels; returns the records left out,
+    // those of inactive channels and unreadable ones
+    size_t Run(const MappedReader &reader, const RecordIndex &record_index, size_t first, size_t last, ResultWriter * const *writers);
+
+    int Threads() const;
+private:
+    struct chunk {
+        size_t first;
+        size_t count;
+        std::vector<float> results;
+        std::vector<int> baseline;
+        std::vector<long long> timestamp;
+        std::vector<long long> recordstart;
+        std::vector<int> channel; // -1 when the record is not analysed
+        bool ready;
+    };
+    struct worker_queue {
+        std::mutex m;
+        std::deque<size_t> chunks;
+    };
+
+    void Work(int id);
+    bool Take(int id, size_t &c);
+    void Push(size_t c);
+    void Analyse(std::unique_ptr<CpuEngine> *engines, std::vector<int16_t> &samples, chunk &ch);
+
+    int nthreads;
+    int chunk_size;
+    channel_args args[MAX_SP_CHANNELS];
+    uint32_t nsamples;
+
+    // Per run state
+    const MappedReader *reader;
+    const RecordIndex *record_index;
+    ResultWriter * const *writers;
+    size_t first;
+    size_t last;
+    std::vector<chunk> window;
+    std::unique_ptr<worker_queue[]> queues;
+    std::atomic<size_t> pending;
+    bool stop;
+    std::mutex m;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+};
+
+#endif /* CPU_POOL_H_ */
@@ -0,0 +1,36 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#ifndef DPSA_DEFINES_H_
+#define DPSA_DEFINES_H_
+
+// Settings of this analysis that the SIMPLE DAQ structures do not have; those stay as the DAQ defines them
+#include "Simple_sp_devices_defines.h"
+
+#define MAX_PSD_POINTS 8 // Points of the energy vs tail/total cut
+
+// Particle of a signal, from its pulse shape
+#define PARTICLE_NONE -1 // Not classified: below the cut, or no PSD
+#define PARTICLE_GAMMA 0
+#define PARTICLE_NEUTRON 1
+
+struct DPSA_PSD_Struct
+{
+  int tail;   // Energy calculations with the tail and total charges
+  int total;
+  int points;
+  float cut_energy[MAX_PSD_POINTS]; // Total charge, increasing. Neutron above the ratio, linear between points
+  float cut_ratio[MAX_PSD_POINTS];
+  int keep;   // PARTICLE_NONE reports every signal, otherwise only that particle
+  bool active;
+};
+
+struct DPSA_Channel_Analysis_Struct : SIMPLE_Channel_Analysis_Struct
+{
+  bool reject_saturated; // Pulses with clipped samples in their window are not analysed
+  DPSA_PSD_Struct psd;
+};
+
+#endif /* DPSA_DEFINES_H_ */
@@ -11,26 +11,33 @@
     }
 
 #include "host.h"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <stdlib.h>
 #include <ap_int.h>
 #include <ap_axi_sdata.h>
 #include <unistd.h>
+#include "coincidence.h"
+#include "cpu_engine.h"
+#include "cpu_pool.h"
 #include "reader.h"
+#include "record_index.h"
 
 #include "SimpleDataProcess.h"
 
 static const short SAMPLES_W = 375;			// n samples = 3000. 8 samples are sent at the same time (JSD204) = 600
 static const short SAMPLES_P = 3000;		// SAMPLES PROCCESS
 static const short SAMPLES_R = 3000;		// SAMPLES READ
-static const short RESULTS_SIZE = 10;
+static const short RESULTS_SIZE = RESULT_FIELDS;
 
 static const short FIR_N = 20;
-static const short CHANNEL = 0;
 static const int BITS16 = 65536; //ADC units
 
 const int MAX_PEAKS = 10;
+const int MAX_PIPELINE_DEPTH = 8;
+const int MAX_BATCH = 64;			// Must match MAX_BATCH in the kernels
+const int ARGS_SIZE = 2;			// Baseline and offset per record
 
 static const std::string error_message =
     "Error: Result mismatch:\n"
@@ -38,44 +45,408 @@ static const std::string error_message =
 
 typedef ap_int<128> uint128_t;
 
-int main(int argc, char* argv[]) {
-    // TARGET_DEVICE macro needs to be passed from gcc command line
-    if (argc != 3) {
-        std::cout << "Usage: " << argv[0] << " <xclbin>" << " config.ini" << std::endl;
-        return EXIT_FAILURE;
-    }
+// One set of device buffers for a batch of records in flight
+struct buffer_set {
+	cl::Buffer d_buffer_w;
+	cl::Buffer d_baseline;
+	cl::Buffer d_buffer_r;
 
-    std::string xclbinFilename = argv[2];
+	uint128_t * host_ptr_w;
+	int * host_baseline_ptr_w;
+	float * host_ptr_r;
 
-    std::vector<cl::Device> devices;
-    cl_int err;
-    cl::Context context;
-    cl::CommandQueue q_tx, q_rx, q_dpsa;
-    cl::Kernel krnl_JESD204B_tx, krnl_JESD204B_rx, krnl_dpsa;
-    cl::Program program;
-    std::vector<cl::Platform> platforms;
-    bool found_device = false;
+	std::vector<cl::Event> done;	// tx kernel + results migration
+	bool busy;
+	int nrecords;					// Records loaded, 0 once the batch is written
+	std::vector<uint32_t> index;
+	std::vector<long long> timestamp;
+	std::vector<long long> recordstart;
+};
+
+// Estimates the acquisition rate from the record timestamps
+struct rate_estimator {
+	double mean_dt;		// Mean time between records [s]
+	long long last_timestamp;
+	bool first;
+};
+
+static void update_rate(rate_estimator & re, long long timestamp, double tick)
+{
+	if (!re.first) {
+		double dt = (timestamp - re.last_timestamp) * tick;
+		if (dt > 0)
+			re.mean_dt = re.mean_dt > 0 ? 0.9 * re.mean_dt + 0.1 * dt : dt;
+	}
+	re.last_timestamp = timestamp;
+	re.first = false;
+}
+
+// Enough records to span the batch latency at the current rate, at least one
+static int choose_batch(const rate_estimator & re, double batch_latency, int max_batch)
+{
+	if (re.mean_dt <= 0)
+		return 1;
+	int batch = batch_latency / re.mean_dt;
+	return batch < 1 ? 1 : batch > max_batch ? max_batch : batch;
+}
+
+struct stream_config {
+	int ring_size;			// Result slots in the circular buffer
+	unsigned int records;	// Records to acquire, 0 runs forever
+	int poll;				// Write pointer polling period [us]
+	int converters;			// JESD_M of krnl_JESD204B_rx_stream
+	bool continuous;		// krnl_dpsa_continuous, one pulse per slot
+};
 
-    // traversing all Platforms To find Xilinx Platform and targeted
-    // Device in Xilinx Platform
-    cl::Platform::get(&platforms);
-    for (size_t i = 0; (i < platforms.size()) & (found_device == false); i++) {
-        cl::Platform platform = platforms[i];
-        std::string platformName = platform.getInfo<CL_PLATFORM_NAME>();
-        if (platformName == "Xilinx") {
-            devices.clear();
-            platform.getDevices(CL_DEVICE_TYPE_ACCELERATOR, &devices);
-            if (devices.size()) {
-                found_device = true;
-                break;
-            }
-        }
-    }
-    if (found_device == false) {
-        std::cout << "Error: Unable to find Target Device " << std::endl;
-        return EXIT_FAILURE;
-    }
+/*
+ * Compute units, queues and buffers of one active channel. Channel i runs on
+ * the compute units numbered i + 1 (krnl_dpsa_1 for channel 0), each with its
+ * own coefficient and table buffers and its own ring of buffer sets.
+ */
+struct channel_path {
+	int channel;
+	cl::CommandQueue q_tx;
+	cl::CommandQueue q_rx;
+	cl::CommandQueue q_dpsa;
+	cl::Kernel krnl_tx;
+	cl::Kernel krnl_rx;
+	cl::Kernel krnl_dpsa;
+	bool launch_rx;			// False when the rx compute unit of another channel feeds this one, or krnl_dpsa_wide takes the tx beats
+
+	cl::Buffer d_h;
+	cl::Buffer d_windows;
+	cl::Buffer d_psd;
+	float * host_h_ptr_w;
+	int * host_windows_ptr_w;
+	float * host_psd_ptr_w;
+	std::vector<cl::Event> h_ready;
+
+	std::vector<buffer_set> sets;
+	int slot;				// Set being filled
+	int batch;				// Records the set is filled with
+	rate_estimator rate;
+	ResultWriter * writer;
+};
+
+// Compute unit <kernel>_<channel + 1>, the one wired to the channel
+static std::string compute_unit(const char * kernel, int channel)
+{
+	return std::string(kernel) + ":{" + kernel + "_" + std::to_string(channel + 1) + "}";
+}
+
+// out.csv becomes out_ch<channel>.csv when several channels are analysed
+static std::string channel_file(const std::string & file, int channel, bool several)
+{
+	if (!several)
+		return file;
+	const size_t slash = file.find_last_of('/');
+	size_t dot = file.find_last_of('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = file.size();
+	return file.substr(0, dot) + "_ch" + std::to_string(channel) + file.substr(dot);
+}
+
+// Run time kernel arguments of a channel from its config.ini settings
+static void channel_setup(const DPSA_Channel_Analysis_Struct & CA, float FS, channel_args & args)
+{
+	args.scale = CA.detection.shaping.rc_scale;
+	args.factor = CA.detection.cfd.factor*args.scale;
+	args.threshold = (float)CA.detection.threshold / FS;
+	args.shaping = CA.detection.shaping.shaping_algorithm;
+
+	/* FIR coefficients, or the pole of the recursive modes */
+	const float b = exp(-1/CA.detection.shaping.rc);
+	const float a = 1 - b;
+	for (int i = 0; i < FIR_N; i++)
+		args.h[i] = 0;
+	if (args.shaping == RC_SHAPING) {
+		for (unsigned int i=0; i<20; i++)
+		{
+			args.h[i] = a*pow(b,i);
+		}
+	} else {
+		args.h[0] = a;
+		args.h[1] = b;
+	}
+
+	/* Energy windows, relative to the zero crossing; the kernel clamps them to its energy range */
+	for (int j = 0; j < MAX_ENERGY_CALCULATIONS; j++) {
+		args.windows[j*WINDOW_ARGS + WINDOW_METHOD] = CA.energy[j].active ? CA.energy[j].calculation_method : NO_ENERGY;
+		args.windows[j*WINDOW_ARGS + WINDOW_FROM] = CA.energy[j].range_from;
+		args.windows[j*WINDOW_ARGS + WINDOW_TO] = CA.energy[j].range_to;
+	}
+
+	/* PSD cut, with the total energies in kernel units */
+	for (int k = 0; k < PSD_ARGS; k++)
+		args.psd[k] = 0;
+	args.psd[PSD_TAIL] = CA.psd.active ? CA.psd.tail : NO_ENERGY;
+	args.psd[PSD_TOTAL] = CA.psd.active ? CA.psd.total : NO_ENERGY;
+	args.psd[PSD_KEEP] = CA.psd.keep;
+	args.psd[PSD_POINTS] = CA.psd.points;
+	for (int k = 0; k < CA.psd.points; k++) {
+		args.psd[PSD_CUT_ENERGY + k] = CA.psd.cut_energy[k] / FS;
+		args.psd[PSD_CUT_RATIO + k] = CA.psd.cut_ratio[k];
+	}
+}
+
+// The kernels clamp the energy windows to their energy range, [signal from, signal from + signal to] around the zero crossing
+static void check_windows(const DPSA_Channel_Analysis_Struct & CA, int channel)
+{
+	const int from = CA.detection.signal_from;
+	const int to = CA.detection.signal_from + CA.detection.signal_to;
+	for (int j = 0; j < MAX_ENERGY_CALCULATIONS; j++) {
+		const int w_from = CA.energy[j].range_from;
+		const int w_to = CA.energy[j].range_to;
+		if (!CA.energy[j].active || (w_from >= from && w_to <= to))
+			continue;
+		std::cout << "WARNING: channel" << channel << " energy" << j << " [" << w_from << ", " << w_to << "]";
+		if (w_from > to || w_to < from)
+			std::cout << " is outside the energy range [" << from << ", " << to << "] and is not computed" << std::endl;
+		else
+			std::cout << " is cut to [" << std::max(w_from, from) << ", " << std::min(w_to, to) << "], the energy range of signal from and signal to" << std::endl;
+	}
+}
+
+// The coefficients and tables of a channel are the same for every record
+static void load_tables(cl::Context & context, cl::CommandQueue & q_mem, const channel_args & args, channel_path & cp)
+{
+	cl_int err;
+	OCL_CHECK(err, cp.d_h = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, FIR_N*sizeof(float), NULL, &err));
+	OCL_CHECK(err, cp.d_windows = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, sizeof(args.windows), NULL, &err));
+	OCL_CHECK(err, cp.d_psd = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, sizeof(args.psd), NULL, &err));
+
+	OCL_CHECK(err, cp.host_h_ptr_w = (float*)q_mem.enqueueMapBuffer(cp.d_h, CL_TRUE, CL_MAP_WRITE, 0, FIR_N*sizeof(float), NULL, NULL, &err));
+	memcpy(cp.host_h_ptr_w, args.h, FIR_N*sizeof(float));
+	OCL_CHECK(err, cp.host_windows_ptr_w = (int*)q_mem.enqueueMapBuffer(cp.d_windows, CL_TRUE, CL_MAP_WRITE, 0, sizeof(args.windows), NULL, NULL, &err));
+	memcpy(cp.host_windows_ptr_w, args.windows, sizeof(args.windows));
+	OCL_CHECK(err, cp.host_psd_ptr_w = (float*)q_mem.enqueueMapBuffer(cp.d_psd, CL_TRUE, CL_MAP_WRITE, 0, sizeof(args.psd), NULL, NULL, &err));
+	memcpy(cp.host_psd_ptr_w, args.psd, sizeof(args.psd));
+
+	cp.h_ready.resize(1);
+	OCL_CHECK(err, err = q_mem.enqueueMigrateMemObjects({cp.d_h, cp.d_windows, cp.d_psd}, 0, NULL, &cp.h_ready[0]));
+}
+
+static void unload_tables(cl::CommandQueue & q_mem, channel_path & cp)
+{
+	cl_int err;
+	OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(cp.d_h, cp.host_h_ptr_w));
+	OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(cp.d_windows, cp.host_windows_ptr_w));
+	OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(cp.d_psd, cp.host_psd_ptr_w));
+}
+
+/*
+ * Free-running acquisition: krnl_JESD204B_rx_stream and krnl_dpsa_stream are
+ * launched once and the host only polls the write pointers of the result rings.
+ * Every channel has its own krnl_dpsa_stream; with several converters on the
+ * JESD204B link, one krnl_JESD204B_rx_stream feeds all of them. In continuous
+ * mode krnl_dpsa_continuous takes its place and a slot holds one pulse, with
+ * its sample in a second ring; a channel is done when its kernel has finished
+ * and its ring is empty. The WIDE datapath runs the _wide builds of all three,
+ * eight samples per cycle.
+ */
+static void run_stream(cl::Context & context, cl::CommandQueue & q_mem, std::vector<channel_path> & paths,
+		const stream_config & sc, int stream_baseline)
+{
+	cl_int err;
+	const size_t slot_size = sc.continuous ? RESULTS_SIZE : MAX_PEAKS*RESULTS_SIZE;
+	const size_t nchannels = paths.size();
+
+	std::vector<cl::Buffer> d_ring(nchannels), d_sample(nchannels), d_wr_ptr(nchannels);
+	std::vector<float *> ring(nchannels);
+	std::vector<unsigned long long *> sample(nchannels, NULL);
+	std::vector<unsigned int *> wr_ptr(nchannels);
+	// Slots read; the kernels count in 32 bits, the host does not wrap
+	std::vector<unsigned long long> rd(nchannels, 0);
+	std::vector<cl::Memory> wr_ptrs;
+	std::vector<cl::Event> dpsa_done(nchannels);
+	std::vector<bool> finished(nchannels, false);
+
+	for (size_t c = 0; c < nchannels; c++) {
+		channel_path & cp = paths[c];
+		OCL_CHECK(err, d_ring[c] = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_WRITE_ONLY, sc.ring_size*slot_size*sizeof(float), NULL, &err));
+		OCL_CHECK(err, d_wr_ptr[c] = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE, sizeof(unsigned int), NULL, &err));
+
+		OCL_CHECK(err, ring[c] = (float*)q_mem.enqueueMapBuffer(d_ring[c], CL_TRUE, CL_MAP_READ, 0, sc.ring_size*slot_size*sizeof(float), NULL, NULL, &err));
+		OCL_CHECK(err, wr_ptr[c] = (unsigned int*)q_mem.enqueueMapBuffer(d_wr_ptr[c], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(unsigned int), NULL, NULL, &err));
+		wr_ptrs.push_back(d_wr_ptr[c]);
+		if (sc.continuous) {
+			OCL_CHECK(err, d_sample[c] = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_WRITE_ONLY, sc.ring_size*sizeof(unsigned long long), NULL, &err));
+			OCL_CHECK(err, sample[c] = (unsigned long long*)q_mem.enqueueMapBuffer(d_sample[c], CL_TRUE, CL_MAP_READ, 0, sc.ring_size*sizeof(unsigned long long), NULL, NULL, &err));
+		}
+
+		*wr_ptr[c] = 0;
+		std::vector<cl::Event> dpsa_ready(2);
+		dpsa_ready[1] = cp.h_ready[0];
+		OCL_CHECK(err, err = q_mem.enqueueMigrateMemObjects({d_wr_ptr[c]}, 0, NULL, &dpsa_ready[0]));
+
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(5, d_ring[c]));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(7, sc.ring_size));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(8, d_wr_ptr[c]));
+		if (sc.continuous) {
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(9, (unsigned long long)sc.records*SAMPLES_P));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(13, d_sample[c]));
+		} else {
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(9, sc.records));
+		}
+
+		if (cp.launch_rx) {
+			OCL_CHECK(err, err = cp.q_rx.enqueueTask(cp.krnl_rx));
+			OCL_CHECK(err, err = cp.q_rx.flush());
+		}
+		OCL_CHECK(err, err = cp.q_dpsa.enqueueTask(cp.krnl_dpsa, &dpsa_ready, &dpsa_done[c]));
+		OCL_CHECK(err, err = cp.q_dpsa.flush());
+	}
 
+	// The stream has no record headers: the baseline is fixed
+	int baseline[ARGS_SIZE] = {stream_baseline, 0};
+	size_t running = nchannels;
+	while (sc.records == 0 || running > 0) {
+		// A kernel that finished before the write pointers are read has written them all
+		std::vector<bool> stopped(nchannels, false);
+		for (size_t c = 0; c < nchannels; c++)
+			stopped[c] = sc.continuous && dpsa_done[c].getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+		OCL_CHECK(err, err = q_mem.enqueueMigrateMemObjects(wr_ptrs, CL_MIGRATE_MEM_OBJECT_HOST));
+		OCL_CHECK(err, err = q_mem.finish());
+		bool idle = true;
+		for (size_t c = 0; c < nchannels; c++) {
+			if (finished[c])
+				continue;
+			const unsigned long long wr = rd[c] + (unsigned int)(*wr_ptr[c] - (unsigned int)rd[c]);
+			if (wr != rd[c]) {
+				idle = false;
+				if (wr - rd[c] > (unsigned long long)sc.ring_size) {
+					std::cerr << "WARNING: channel" << paths[c].channel << " result ring overrun, " << wr - rd[c] - sc.ring_size << (sc.continuous ? " pulses" : " records") << " lost" << std::endl;
+					rd[c] = wr - sc.ring_size;
+				}
+
+				OCL_CHECK(err, err = q_mem.enqueueMigrateMemObjects({d_ring[c]}, CL_MIGRATE_MEM_OBJECT_HOST));
+				if (sc.continuous) {
+					OCL_CHECK(err, err = q_mem.enqueueMigrateMemObjects({d_sample[c]}, CL_MIGRATE_MEM_OBJECT_HOST));
+				}
+				OCL_CHECK(err, err = q_mem.finish());
+				for (; rd[c] != wr && (sc.continuous || sc.records == 0 || rd[c] < sc.records); rd[c]++) {
+					const size_t s = rd[c] % sc.ring_size;
+					// Stream records are back to back, so a record starts SAMPLES_P samples after the previous one
+					paths[c].writer->Write(ring[c] + s*slot_size, baseline, rd[c] + 1, sc.continuous ? sample[c][s] : rd[c]*SAMPLES_P, 0);
+				}
+			}
+			if (sc.records != 0 && (sc.continuous ? stopped[c] : rd[c] >= sc.records)) {
+				finished[c] = true;
+				running--;
+			}
+		}
+		if (idle)
+			usleep(sc.poll);
+	}
+
+	for (size_t c = 0; c < nchannels; c++) {
+		OCL_CHECK(err, paths[c].q_rx.finish());
+		OCL_CHECK(err, paths[c].q_dpsa.finish());
+		OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(d_ring[c], ring[c]));
+		if (sc.continuous) {
+			OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(d_sample[c], sample[c]));
+		}
+		OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(d_wr_ptr[c], wr_ptr[c]));
+	}
+	OCL_CHECK(err, q_mem.finish());
+}
+
+// Wait for the batch held by a buffer set and write its results
+static void retire(buffer_set & bs, ResultWriter & writer)
+{
+	if (!bs.busy)
+		return;
+	cl_int err;
+	OCL_CHECK(err, err = cl::WaitForEvents(bs.done));
+	for (int r = 0; r < bs.nrecords; r++)
+		writer.Write(bs.host_ptr_r + r*MAX_PEAKS*RESULTS_SIZE, bs.host_baseline_ptr_w + r*ARGS_SIZE, bs.index[r], bs.timestamp[r], bs.recordstart[r]);
+	bs.busy = false;
+	bs.nrecords = 0;
+}
+
+// Starts the kernels of a channel on the set being filled and moves on to the next set
+static void launch(cl::CommandQueue & q_mem, channel_path & cp)
+{
+	cl_int err;
+	buffer_set & bs = cp.sets[cp.slot];
+
+	// Data will be migrated to kernel space
+	std::vector<cl::Event> w_ready(1), dpsa_ready(2), dpsa_done(1);
+	dpsa_ready[1] = cp.h_ready[0];
+	OCL_CHECK(err, err = q_mem.enqueueMigrateMemObjects({bs.d_buffer_w}, 0, NULL, &w_ready[0]));
+	OCL_CHECK(err, err = q_mem.enqueueMigrateMemObjects({bs.d_baseline}, 0, NULL, &dpsa_ready[0]));
+
+	// Launch the Kernel
+	const short nrecords = bs.nrecords;
+	bs.done.resize(2);
+	OCL_CHECK(err, err = cp.krnl_tx.setArg(1, bs.d_buffer_w));
+	OCL_CHECK(err, err = cp.krnl_tx.setArg(3, nrecords));
+	OCL_CHECK(err, err = cp.krnl_dpsa.setArg(1, bs.d_baseline));
+	OCL_CHECK(err, err = cp.krnl_dpsa.setArg(5, bs.d_buffer_r));
+	OCL_CHECK(err, err = cp.krnl_dpsa.setArg(8, nrecords));
+	OCL_CHECK(err, err = cp.q_tx.enqueueTask(cp.krnl_tx, &w_ready, &bs.done[0]));
+	if (cp.launch_rx) {
+		OCL_CHECK(err, err = cp.krnl_rx.setArg(3, nrecords));
+		OCL_CHECK(err, err = cp.q_rx.enqueueTask(cp.krnl_rx));
+	}
+	OCL_CHECK(err, err = cp.q_dpsa.enqueueTask(cp.krnl_dpsa, &dpsa_ready, &dpsa_done[0]));
+
+	OCL_CHECK(err, err = cp.q_dpsa.enqueueMigrateMemObjects({bs.d_buffer_r}, CL_MIGRATE_MEM_OBJECT_HOST, &dpsa_done, &bs.done[1]));
+
+	bs.busy = true;
+	cp.slot = (cp.slot + 1) % cp.sets.size();
+}
+
+// Same records and results as the FPGA path, analysed by the host
+static size_t run_cpu(MappedReader & reader, const RecordIndex & record_index, bool use_index, size_t first, size_t last,
+		const channel_args * args, ResultWriter * const * writers)
+{
+	std::unique_ptr<CpuEngine> engines[MAX_SP_CHANNELS];
+	for (int i = 0; i < MAX_SP_CHANNELS; i++)
+		if (writers[i])
+			engines[i].reset(new CpuEngine(args[i]));
+	std::vector<int16_t> samples(SAMPLES_P);
+	float result[MAX_PEAKS*RESULTS_SIZE];
+	record_view record;
+	size_t skipped = 0;
+
+	uint32_t index = first;
+	while (!use_index || index < last) {
+		if (use_index)
+			reader.Seek(record_index[index].offset);
+		if (reader.NextRecord(record) != NO_ERROR)
+			break;
+		index++;
+
+		const int channel = record.header->channel;
+		if (channel < 0 || channel >= MAX_SP_CHANNELS || !engines[channel]) {
+			skipped++;
+			continue;
+		}
+		MappedReader::CopySamples(record, samples.data(), SAMPLES_P);
+		const int baseline[ARGS_SIZE] = {record.header->moving_average, 0};
+		engines[channel]->Analyse(samples.data(), SAMPLES_P, baseline[BS], result);
+		writers[channel]->Write(result, baseline, index, record.header->timestamp, record.header->recordstart);
+	}
+	return skipped;
+}
+
+// Once every writer is closed, the builder has all the pulses
+static void close_coincidence(CoincidenceBuilder * coincidence)
+{
+	if (!coincidence)
+		return;
+	coincidence->Close();
+	std::cout << "INFO: " << coincidence->Accepted() << " events in coincidence, " << coincidence->Rejected() << " rejected" << std::endl;
+	if (coincidence->Late())
+		std::cout << "WARNING: " << coincidence->Late() << " events merged out of order, increase Writer ring size" << std::endl;
+}
+
+// Loads the xclbin and programs the first device that accepts it
+static bool program_device(std::string & xclbinFilename, std::vector<cl::Device> & devices, cl::Context & context,
+		cl::Device & device, cl::CommandQueue & q_mem, cl::Program & program)
+{
+    cl_int err;
     std::cout << "INFO: Reading " << xclbinFilename << std::endl;
     FILE* fp;
     if ((fp = fopen(xclbinFilename.c_str(), "r")) == nullptr) {
@@ -96,47 +467,66 @@ int main(int argc, char* argv[]) {
     bins.push_back({buf, nb});
     bool valid_device = false;
     for (unsigned int i = 0; i < devices.size(); i++) {
-        auto device = devices[i];
-        // Creating Context and Command Queue for selected Device
+        device = devices[i];
+        // Creating Context and Command Queue for selected Device; the kernel queues are per channel
         OCL_CHECK(err, context = cl::Context(device, nullptr, nullptr, nullptr, &err));
-        OCL_CHECK(err, q_tx = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err));
-        OCL_CHECK(err, q_rx = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err));
-        OCL_CHECK(err, q_dpsa = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err));
+        OCL_CHECK(err, q_mem = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err));
         std::cout << "Trying to program device[" << i << "]: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
-        cl::Program program(context, {device}, bins, nullptr, &err);
+        program = cl::Program(context, {device}, bins, nullptr, &err);
         if (err != CL_SUCCESS) {
             std::cout << "Failed to program device[" << i << "] with xclbin file!\n";
         } else {
-            OCL_CHECK(err, krnl_JESD204B_tx = cl::Kernel(program, "krnl_JESD204B_tx", &err));
-            OCL_CHECK(err, krnl_JESD204B_rx = cl::Kernel(program, "krnl_JESD204B_rx", &err));
-            OCL_CHECK(err, krnl_dpsa = cl::Kernel(program, "krnl_dpsa", &err));
             valid_device = true;
             std::cout << "Device[" << i << "]: program successful!" << std::endl;
             break; // we break because we found a valid device
         }
     }
-    if (!valid_device) {
-        std::cout << "Failed to program any device found, exit!"  << std::endl;
-        exit(EXIT_FAILURE);
+    return valid_device;
+}
+
+int main(int argc, char* argv[]) {
+    // TARGET_DEVICE macro needs to be passed from gcc command line
+    if (argc != 3) {
+        std::cout << "Usage: " << argv[0] << " <xclbin>" << " config.ini" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    /*Allocate host memory*/
-	uint128_t * host_ptr_w;
-	float * host_h_ptr_w;
-	float * host_ptr_r;
-	int * host_baseline_ptr_w;
+    std::string xclbinFilename = argv[2];
 
-	// Allocate memory on the Device
-    OCL_CHECK(err, cl::Buffer d_buffer_w(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, SAMPLES_W*sizeof(uint128_t), NULL, &err));
-    OCL_CHECK(err, cl::Buffer d_h(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, FIR_N*sizeof(float), NULL, &err));
-    OCL_CHECK(err, cl::Buffer d_baseline(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, 2*sizeof(int), NULL, &err));
-    OCL_CHECK(err, cl::Buffer d_buffer_r(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_WRITE_ONLY, MAX_PEAKS*RESULTS_SIZE*sizeof(float), NULL, &err));
+    std::vector<cl::Device> devices;
+    cl_int err;
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue q_mem;
+    cl::Program program;
+    std::vector<cl::Platform> platforms;
+    bool found_device = false;
 
-    // Set the kernel Arguments
+    // traversing all Platforms To find Xilinx Platform and targeted
+    // Device in Xilinx Platform
+    cl::Platform::get(&platforms);
+    for (size_t i = 0; (i < platforms.size()) & (found_device == false); i++) {
+        cl::Platform platform = platforms[i];
+        std::string platformName = platform.getInfo<CL_PLATFORM_NAME>();
+        if (platformName == "Xilinx") {
+            devices.clear();
+            platform.getDevices(CL_DEVICE_TYPE_ACCELERATOR, &devices);
+            if (devices.size()) {
+                found_device = true;
+                break;
+            }
+        }
+    }
+    if (found_device == false) {
+        std::cout << "INFO: Unable to find Target Device, analysing on the CPU (" << CpuEngine::Isa() << ")" << std::endl;
+    } else if (!program_device(xclbinFilename, devices, context, device, q_mem, program)) {
+        std::cout << "Failed to program any device found, exit!"  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const bool use_cpu = !found_device;
 
     // Signal headers
 	SP_Devices_DataBlock_Information card_header;
-	SP_Devices_Monster_Data_Header record_header;
 
 	Simple_Data_Process *sdp = new Simple_Data_Process();
 	if (sdp->configure(argv[1]) != 0){
@@ -144,145 +534,370 @@ int main(int argc, char* argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-	const SIMPLE_Channel_Analysis_Struct CA = sdp->CA[CHANNEL];
+	// Every active channel is analysed with its own settings
+	DPSA_Channel_Analysis_Struct CA[MAX_SP_CHANNELS];
+	std::vector<int> channels;
+	for (int i = 0; i < MAX_SP_CHANNELS; i++) {
+		CA[i] = sdp->CA[i];
+		if (CA[i].active)
+			channels.push_back(i);
+	}
+	if (channels.empty()) {
+		std::cout << "No active channel, exit!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int pipeline_depth = sdp->pipeline_depth;
+	if (pipeline_depth < 1 || pipeline_depth > MAX_PIPELINE_DEPTH) {
+		std::cout << "Pipeline depth must be between 1 and " << MAX_PIPELINE_DEPTH << ", exit!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int max_batch = sdp->max_batch;
+	if (max_batch < 1 || max_batch > MAX_BATCH) {
+		std::cout << "Max batch must be between 1 and " << MAX_BATCH << ", exit!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	const double batch_latency = sdp->batch_latency*1e-6;
+	const bool fixed_datapath = sdp->fixed_datapath;
+	const bool wide_datapath = sdp->wide_datapath;
+
+	const bool stream_mode = sdp->stream_mode;
+	const stream_config sc = {sdp->stream_ring_size, (unsigned int)sdp->stream_records, sdp->stream_poll, sdp->stream_converters, sdp->continuous_mode};
+	const int stream_baseline = sdp->stream_baseline;
+	if (stream_mode && sc.ring_size < 1) {
+		std::cout << "Stream ring size must be positive, exit!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (stream_mode && (sc.converters < 1 || sc.converters > MAX_SP_CHANNELS)) {
+		std::cout << "Stream converters must be between 1 and " << MAX_SP_CHANNELS << ", exit!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (stream_mode && fixed_datapath) {
+		std::cout << "Stream acquisition has the FLOAT and WIDE datapaths only, exit!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (stream_mode && sc.converters > 1 && channels.back() >= sc.converters) {
+		std::cout << "channel" << channels.back() << " has no converter on the JESD204B link, exit!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
 
 	std::string IN_FILE = sdp->input_file;
 	std::string OUT_FILE = sdp->output_file;
+	const output_format out_format = sdp->output_binary ? OUTPUT_BINARY : OUTPUT_CSV;
+	const int writer_ring_size = sdp->writer_ring_size;
+	std::string COINCIDENCE_FILE = sdp->coincidence_file;
+	const int cpu_threads = sdp->cpu_threads;
+	const int cpu_chunk = sdp->cpu_chunk;
+
+	// Any record selection needs the offset index
+	const bool use_index = sdp->record_index || sdp->record_from > 0 || sdp->record_to >= 0 ||
+			sdp->timestamp_from >= 0 || sdp->timestamp_to >= 0;
+	const long long record_from = sdp->record_from, record_to = sdp->record_to;
+	const long long timestamp_from = sdp->timestamp_from, timestamp_to = sdp->timestamp_to;
 
 	sdp->~Simple_Data_Process();
 
 	/*Reader */
-	 std::unique_ptr<Reader> reader(new Reader(IN_FILE));
+	std::unique_ptr<MappedReader> reader(new MappedReader(IN_FILE));
 
 	reader_response res = reader->ReadCardHeader(card_header);
 	if(res > 0)
 		std::cout << "ERROR" << std::endl;
 
+	// Records [first, last) are analysed
+	RecordIndex record_index;
+	size_t first = 0, last = (size_t) -1;
+	if (use_index && !stream_mode) {
+		if (record_index.Open(IN_FILE, *reader) != NO_ERROR) {
+			std::cout << "Failed to index " << IN_FILE << ", exit!" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		last = record_index.Size();
+		if (record_from > 0)
+			first = record_from;
+		if (record_to >= 0 && (size_t) record_to < last)
+			last = record_to;
+		if (timestamp_from >= 0 || timestamp_to >= 0) {
+			if (!record_index.Sorted()) {
+				std::cout << "Timestamps are not sorted, timestamp range ignored" << std::endl;
+			} else {
+				if (timestamp_from >= 0)
+					first = std::max(first, record_index.Find(timestamp_from));
+				if (timestamp_to >= 0)
+					last = std::min(last, record_index.Find(timestamp_to));
+			}
+		}
+		std::cout << "Indexed " << record_index.Size() << " records, analysing [" << first << ", " << last << ")" << std::endl;
+	}
+
 	const float SampleRate = card_header.i64Frequency*1e-9;
 	const float SampleRate_1 = 1/SampleRate;
 
-	float offset = card_header.iOffset[0];
-
-	const int PreTrigger_Delay = card_header.firmware[2] == 'D' ?
-			-card_header.iFWDAQ_Delay :
-			card_header.iFWPD_LEW[0]*SampleRate;
+	// Record timestamps count sample clock ticks
+	const double tick = 1.0/card_header.i64Frequency;
+
+	// Pulses of every channel merged by time, with the coincidence settings of the card
+	std::unique_ptr<CoincidenceBuilder> coincidence;
+	if (COINCIDENCE_FILE.compare("NONE")) {
+		unsigned int mask = 0;
+		for (int ch : channels)
+			mask |= 1u << ch;
+		coincidence.reset(new CoincidenceBuilder(writer_ring_size, card_header, mask));
+		if (coincidence->Open(COINCIDENCE_FILE, out_format, IN_FILE) != 0) {
+			std::cout << "Failed to open " << COINCIDENCE_FILE << ", exit!" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	float FS = card_header.FullVerticalScale[CHANNEL]/BITS16;
+	// Kernel arguments and one result file per active channel
+	channel_args args[MAX_SP_CHANNELS] = {};
+	std::unique_ptr<ResultWriter> writers[MAX_SP_CHANNELS];
+	ResultWriter * channel_writer[MAX_SP_CHANNELS] = {NULL};
+	for (int ch : channels) {
+		const float FS = card_header.FullVerticalScale[ch]/BITS16;
+		const float offset = card_header.iOffset[ch];
+		// Continuous pulse times are offsets from their sample, not from a trigger
+		const int PreTrigger_Delay = sc.continuous ? 0 : card_header.firmware[2] == 'D' ?
+				-card_header.iFWDAQ_Delay :
+				card_header.iFWPD_LEW[ch]*SampleRate;
+		channel_setup(CA[ch], FS, args[ch]);
+		check_windows(CA[ch], ch);
+
+		// Units and configuration go in the header of binary result files
+		result_file_header out_header = {};
+		out_header.units = {FS, offset, SampleRate_1, PreTrigger_Delay};
+		out_header.threshold = args[ch].threshold;
+		out_header.cfd_factor = CA[ch].detection.cfd.factor;
+		out_header.rc = CA[ch].detection.shaping.rc;
+		out_header.rc_scale = args[ch].scale;
+		out_header.channel = ch;
+		out_header.nsamples = SAMPLES_P;
+		out_header.continuous = sc.continuous;
+		strncpy(out_header.input_file, IN_FILE.c_str(), sizeof(out_header.input_file) - 1);
+
+		std::string out_file = channel_file(OUT_FILE, ch, channels.size() > 1);
+		writers[ch].reset(new ResultWriter(writer_ring_size));
+		writers[ch]->Attach(coincidence.get());
+		if (writers[ch]->Open(out_file, out_format, out_header) != 0) {
+			std::cout << "Failed to open " << out_file << ", exit!" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		channel_writer[ch] = writers[ch].get();
+	}
+	std::cout << "INFO: " << channels.size() << " active channels" << std::endl;
 
-	float scale = CA.detection.shaping.rc_scale;
-	float factor = CA.detection.cfd.factor*scale;
-	float threshold = (float)CA.detection.threshold / FS;
+	if (use_cpu) {
+		if (stream_mode) {
+			std::cout << "Stream acquisition needs the FPGA, exit!" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		// Several workers need the record offsets to share out the file
+		CpuPool pool(cpu_threads, cpu_chunk, args, SAMPLES_P);
+		if (pool.Threads() > 1 && !use_index) {
+			if (record_index.Build(*reader) != NO_ERROR) {
+				std::cout << "Failed to index " << IN_FILE << ", exit!" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			last = record_index.Size();
+		}
+		std::cout << "INFO: " << pool.Threads() << " CPU threads" << std::endl;
+
+		size_t skipped;
+		if (pool.Threads() > 1)
+			skipped = pool.Run(*reader, record_index, first, last, channel_writer);
+		else
+			skipped = run_cpu(*reader, record_index, use_index, first, last, args, channel_writer);
+		if (skipped)
+			std::cout << "INFO: " << skipped << " records of inactive channels skipped" << std::endl;
+
+		for (int ch : channels)
+			writers[ch]->Close();
+		close_coincidence(coincidence.get());
+		reader.reset();
+		std::cout << "done" << std::endl;
+		return (EXIT_SUCCESS);
+	}
 
-	float rc = CA.detection.shaping.rc;
+	// Compute units, queues and tables of every active channel
+	std::vector<channel_path> paths(channels.size());
+	int route[MAX_SP_CHANNELS];
+	for (int i = 0; i < MAX_SP_CHANNELS; i++)
+		route[i] = -1;
+	for (size_t c = 0; c < channels.size(); c++) {
+		channel_path & cp = paths[c];
+		cp.channel = channels[c];
+		cp.writer = channel_writer[cp.channel];
+		route[cp.channel] = c;
+		OCL_CHECK(err, cp.q_tx = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err));
+		OCL_CHECK(err, cp.q_rx = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err));
+		OCL_CHECK(err, cp.q_dpsa = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err));
+		load_tables(context, q_mem, args[cp.channel], cp);
+	}
 
-    OCL_CHECK(err, err = krnl_JESD204B_tx.setArg(1, d_buffer_w));
-    OCL_CHECK(err, err = krnl_JESD204B_tx.setArg(2, SAMPLES_W));
-    OCL_CHECK(err, err = krnl_JESD204B_rx.setArg(2, SAMPLES_W));
+	if (stream_mode) {
+		const char * rx = wide_datapath ? "krnl_JESD204B_rx_stream_wide" : "krnl_JESD204B_rx_stream";
+		const char * dpsa = sc.continuous ? (wide_datapath ? "krnl_dpsa_continuous_wide" : "krnl_dpsa_continuous") :
+				(wide_datapath ? "krnl_dpsa_stream_wide" : "krnl_dpsa_stream");
+		// Converter m of a shared rx compute unit feeds channel m
+		unsigned int converters = 0;
+		for (int ch : channels)
+			converters |= 1u << ch;
+		for (channel_path & cp : paths) {
+			const channel_args & a = args[cp.channel];
+			cp.launch_rx = sc.converters == 1 || &cp == &paths[0];
+			if (cp.launch_rx) {
+				OCL_CHECK(err, cp.krnl_rx = cl::Kernel(program, compute_unit(rx, sc.converters == 1 ? cp.channel : 0).c_str(), &err));
+				OCL_CHECK(err, err = cp.krnl_rx.setArg(1, SAMPLES_W));
+				OCL_CHECK(err, err = cp.krnl_rx.setArg(2, sc.records));
+				OCL_CHECK(err, err = cp.krnl_rx.setArg(3, sc.converters == 1 ? 1u : converters));
+			}
+			OCL_CHECK(err, cp.krnl_dpsa = cl::Kernel(program, compute_unit(dpsa, cp.channel).c_str(), &err));
+
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(1, cp.d_h));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(2, a.factor));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(3, a.threshold));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(4, stream_baseline));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(6, a.scale));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(10, a.shaping));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(11, cp.d_windows));
+			OCL_CHECK(err, err = cp.krnl_dpsa.setArg(12, cp.d_psd));
+		}
 
-	OCL_CHECK(err, err = krnl_dpsa.setArg(1, d_baseline));
-	OCL_CHECK(err, err = krnl_dpsa.setArg(2, d_h));
-	OCL_CHECK(err, err = krnl_dpsa.setArg(3, factor));
-	OCL_CHECK(err, err = krnl_dpsa.setArg(4, threshold));
-	OCL_CHECK(err, err = krnl_dpsa.setArg(5, d_buffer_r));
-	OCL_CHECK(err, err = krnl_dpsa.setArg(6, scale));
-	OCL_CHECK(err, err = krnl_dpsa.setArg(7, SAMPLES_P));
+		run_stream(context, q_mem, paths, sc, stream_baseline);
 
-	// Map OpenCL buffers to get the pointers
-	OCL_CHECK(err, host_ptr_w = (uint128_t*)q_tx.enqueueMapBuffer(d_buffer_w, CL_TRUE, CL_MAP_WRITE, 0, SAMPLES_W*sizeof(uint128_t), NULL, NULL, &err));
-	OCL_CHECK(err, host_h_ptr_w = (float*)q_dpsa.enqueueMapBuffer(d_h, CL_TRUE, CL_MAP_WRITE, 0, FIR_N*sizeof(float), NULL, NULL, &err));
-	OCL_CHECK(err, host_baseline_ptr_w = (int*)q_dpsa.enqueueMapBuffer(d_baseline, CL_TRUE, CL_MAP_WRITE, 0, 2*sizeof(int), NULL, NULL, &err));
-	OCL_CHECK(err, host_ptr_r = (float*)q_dpsa.enqueueMapBuffer(d_buffer_r, CL_TRUE, CL_MAP_READ, 0, RESULTS_SIZE*MAX_PEAKS*sizeof(float), NULL, NULL, &err));
+		for (channel_path & cp : paths) {
+			cp.writer->Close();
+			unload_tables(q_mem, cp);
+		}
+		close_coincidence(coincidence.get());
+		OCL_CHECK(err, q_mem.finish());
+		return (EXIT_SUCCESS);
+	}
 
-	std::cout << "Mapped input signal buffer to host memory" << std::endl;
+	for (channel_path & cp : paths) {
+		const channel_args & a = args[cp.channel];
+		OCL_CHECK(err, cp.krnl_tx = cl::Kernel(program, compute_unit("krnl_JESD204B_tx", cp.channel).c_str(), &err));
+		const char * dpsa = wide_datapath ? "krnl_dpsa_wide" : fixed_datapath ? "krnl_dpsa_fixed" : "krnl_dpsa";
+		OCL_CHECK(err, cp.krnl_dpsa = cl::Kernel(program, compute_unit(dpsa, cp.channel).c_str(), &err));
+
+		OCL_CHECK(err, err = cp.krnl_tx.setArg(2, SAMPLES_W));
+		cp.launch_rx = !wide_datapath;
+		if (cp.launch_rx) {
+			OCL_CHECK(err, cp.krnl_rx = cl::Kernel(program, compute_unit("krnl_JESD204B_rx", cp.channel).c_str(), &err));
+			OCL_CHECK(err, err = cp.krnl_rx.setArg(2, SAMPLES_W));
+		}
 
-	/* FIR coefficients */
-	const float b = exp(-1/rc);
-	const float a = 1 - b;
-	float * h = (float *) host_h_ptr_w;
-	for (unsigned int i=0; i<20; i++)
-	{
-		h[i] = a*pow(b,i);
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(2, cp.d_h));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(3, a.factor));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(4, a.threshold));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(6, a.scale));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(7, SAMPLES_P));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(9, a.shaping));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(10, cp.d_windows));
+		OCL_CHECK(err, err = cp.krnl_dpsa.setArg(11, cp.d_psd));
+
+		// Ring of buffer sets: batch N+1 is loaded and migrated while batch N is analysed.
+		// Each set holds up to max_batch records packed back to back.
+		cp.sets.resize(pipeline_depth);
+		for (buffer_set & bs : cp.sets) {
+			OCL_CHECK(err, bs.d_buffer_w = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, max_batch*SAMPLES_W*sizeof(uint128_t), NULL, &err));
+			OCL_CHECK(err, bs.d_baseline = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, max_batch*ARGS_SIZE*sizeof(int), NULL, &err));
+			OCL_CHECK(err, bs.d_buffer_r = cl::Buffer(context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_WRITE_ONLY, max_batch*MAX_PEAKS*RESULTS_SIZE*sizeof(float), NULL, &err));
+
+			// Map OpenCL buffers to get the pointers
+			OCL_CHECK(err, bs.host_ptr_w = (uint128_t*)q_mem.enqueueMapBuffer(bs.d_buffer_w, CL_TRUE, CL_MAP_WRITE, 0, max_batch*SAMPLES_W*sizeof(uint128_t), NULL, NULL, &err));
+			OCL_CHECK(err, bs.host_baseline_ptr_w = (int*)q_mem.enqueueMapBuffer(bs.d_baseline, CL_TRUE, CL_MAP_WRITE, 0, max_batch*ARGS_SIZE*sizeof(int), NULL, NULL, &err));
+			OCL_CHECK(err, bs.host_ptr_r = (float*)q_mem.enqueueMapBuffer(bs.d_buffer_r, CL_TRUE, CL_MAP_READ, 0, max_batch*RESULTS_SIZE*MAX_PEAKS*sizeof(float), NULL, NULL, &err));
+			bs.busy = false;
+			bs.nrecords = 0;
+			bs.index.resize(max_batch);
+			bs.timestamp.resize(max_batch);
+			bs.recordstart.resize(max_batch);
+		}
+		cp.slot = 0;
+		cp.batch = 1;
+		cp.rate = {0, 0, true};
 	}
 
-	/*Get waveforms from file and fill host buffer*/
-	short * data = (short *) host_ptr_w;
-	int * baseline = (int *) host_baseline_ptr_w;
-	float * data_r = (float *) host_ptr_r;
+	std::cout << "Mapped input signal buffer to host memory" << std::endl;
 
 	/*Signal variables*/
-	uint32_t index = 0;
-	uint32_t nsamples;
+	uint32_t index = first;
+	record_view record;
+	size_t skipped = 0;
+
+	// Records are routed by their channel to the buffer set that channel is filling
+	for (;;) {
+		if (use_index) {
+			if (index >= last)
+				break;
+			reader->Seek(record_index[index].offset);
+		}
+		if (reader->NextRecord(record) != NO_ERROR)
+			break;
+		const SP_Devices_Monster_Data_Header & record_header = *record.header;
+		index++;
+
+		const int channel = record_header.channel;
+		if (channel < 0 || channel >= MAX_SP_CHANNELS || route[channel] < 0) {
+			skipped++;
+			continue;
+		}
+		channel_path & cp = paths[route[channel]];
+		buffer_set & bs = cp.sets[cp.slot];
 
-	std::vector<int16_t> waveform;
+		// The oldest batch in flight leaves the ring before its buffers are reused
+		retire(bs, *cp.writer);
+		if (bs.nrecords == 0)
+			cp.batch = choose_batch(cp.rate, batch_latency, max_batch);
 
-	int satured;
+		// Samples go straight from the mapped file to the mapped device buffer
+		const int r = bs.nrecords;
+		MappedReader::CopySamples(record, (int16_t *) (bs.host_ptr_w + r*SAMPLES_W), SAMPLES_P);
 
-	long unsigned int card_header_size = sizeof(card_header);
-	long unsigned int record_header_size = sizeof(record_header);
+		int * baseline = bs.host_baseline_ptr_w + r*ARGS_SIZE;
 
-	FILE *Output_fp= freopen(OUT_FILE.c_str(),"w",stdout);
+		baseline[BS] = record_header.moving_average;
+		baseline[OF] = 0;
 
-	do{
-		res = reader->ReadRecordHeader(nsamples, index, card_header_size, record_header_size, record_header);
-		res = reader->ReadWaveform(index, waveform, nsamples, card_header_size, record_header_size);
+		bs.index[r] = index;
+		bs.timestamp[r] = record_header.timestamp;
+		bs.recordstart[r] = record_header.recordstart;
+		update_rate(cp.rate, record_header.timestamp, tick);
+		bs.nrecords++;
 
-		baseline[0] = record_header.moving_average;
-		baseline[1] = 0;
+		if (bs.nrecords == cp.batch)
+			launch(q_mem, cp);
+	}
+	if (skipped)
+		std::cout << "INFO: " << skipped << " records of inactive channels skipped" << std::endl;
+
+	// Launch the partial batches, then drain the records still in flight, oldest first
+	for (channel_path & cp : paths) {
+		if (cp.sets[cp.slot].nrecords > 0)
+			launch(q_mem, cp);
+		for (int i = 0; i < pipeline_depth; i++)
+			retire(cp.sets[(cp.slot + i) % pipeline_depth], *cp.writer);
+	}
 
-		for (int i = 0; i < SAMPLES_P; i++){
-			data[i] = waveform[i];
-		}
+	reader.reset();
 
-		// Data will be migrated to kernel space
-		OCL_CHECK(err, err = q_tx.enqueueMigrateMemObjects({d_buffer_w}, 0));
-		OCL_CHECK(err, err = q_dpsa.enqueueMigrateMemObjects({d_baseline, d_h }, 0));
-
-		// Launch the Kernel
-		OCL_CHECK(err, err = q_tx.enqueueTask(krnl_JESD204B_tx));
-		OCL_CHECK(err, err = q_rx.enqueueTask(krnl_JESD204B_rx));
-		OCL_CHECK(err, err = q_dpsa.enqueueTask(krnl_dpsa));
-
-		satured = record_header.status % 2;
-
-		OCL_CHECK(err, q_dpsa.enqueueMigrateMemObjects({d_buffer_r}, CL_MIGRATE_MEM_OBJECT_HOST));
-
-		OCL_CHECK(err, q_tx.finish());
-		OCL_CHECK(err, q_rx.finish());
-		OCL_CHECK(err, q_dpsa.finish());
-
-		/*Write data to files*/
-
-		int npeaks = data_r[NPEAKS];
-		std::cout << index << ",";
-		for (int peak = 0; peak < npeaks; ++peak ){
-			for(int i = 0; i < RESULTS_SIZE; i++){
-				if (i == SATURED)
-					data_r[peak*RESULTS_SIZE + i] = satured;
-				else if (i == BASELINE)
-					data_r[peak*RESULTS_SIZE + i] = (data_r[peak*RESULTS_SIZE + i] + baseline[0]) * FS - offset;
-				else if (i == STDBASELINE)
-					data_r[peak*RESULTS_SIZE + i] = (data_r[peak*RESULTS_SIZE + i])* FS;
-				else if (i == PTIME)
-					data_r[peak*RESULTS_SIZE + i] = data_r[peak*RESULTS_SIZE + i] * SampleRate_1 - PreTrigger_Delay;
-				else if (i >= MAX)
-					data_r[peak*RESULTS_SIZE + i] *= FS;
-				std::cout << data_r[peak*RESULTS_SIZE + i] << ",";
-			}
+	for (channel_path & cp : paths) {
+		cp.writer->Close();
+		for (buffer_set & bs : cp.sets) {
+			OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(bs.d_buffer_w, bs.host_ptr_w));
+			OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(bs.d_baseline, bs.host_baseline_ptr_w));
+			OCL_CHECK(err, err = q_mem.enqueueUnmapMemObject(bs.d_buffer_r, bs.host_ptr_r));
 		}
-		std::cout << std::endl;
+		unload_tables(q_mem, cp);
 
-	} while (res == NO_ERROR);
-
-	reader->~Reader();
-
-	fclose(Output_fp);
-	OCL_CHECK(err, err = q_tx.enqueueUnmapMemObject(d_buffer_w, host_ptr_w));
-	OCL_CHECK(err, err = q_dpsa.enqueueUnmapMemObject(d_h, host_h_ptr_w));
-	OCL_CHECK(err, err = q_dpsa.enqueueUnmapMemObject(d_buffer_r,host_ptr_r));
-
-	OCL_CHECK(err, q_tx.finish());
-	OCL_CHECK(err, q_rx.finish());
-	OCL_CHECK(err, q_dpsa.finish());
+		OCL_CHECK(err, cp.q_tx.finish());
+		OCL_CHECK(err, cp.q_rx.finish());
+		OCL_CHECK(err, cp.q_dpsa.finish());
+	}
+	close_coincidence(coincidence.get());
+	OCL_CHECK(err, q_mem.finish());
 
     std::cout << "done" << std::endl;
     return (EXIT_SUCCESS);
@@ -5,6 +5,11 @@
 
 #include "reader.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 Reader::Reader(std::string &filename) : file(filename, std::ios::binary) {
 	if (!file.is_open()){
 			std::cout<< "File not open"<<std::endl;
@@ -80,3 +85,121 @@ reader_response Reader::ReadWaveform(
 
 	return NO_ERROR;
 }
+
+MappedReader::MappedReader(std::string &filename) : fd(-1), data(NULL), size(0), cursor(0) {
+	fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0){
+		std::cout<< "File not open"<<std::endl;
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+		return;
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED){
+		std::cout<< "File not mapped"<<std::endl;
+		return;
+	}
+
+	// Records are consumed once, front to back
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	data = (const char*) map;
+	size = st.st_size;
+}
+
+MappedReader::~MappedReader() {
+	if (data)
+		munmap((void*) data, size);
+	if (fd >= 0)
+		close(fd);
+}
+
+reader_response MappedReader::ReadCardHeader(SP_Devices_DataBlock_Information &card_header)
+{
+	if (!data || size < sizeof(card_header)){
+		std::cout<<"File open fail"<<std::endl;
+		return ERROR;
+	}
+
+	memcpy(&card_header, data, sizeof(card_header));
+	cursor = sizeof(card_header);
+	return NO_ERROR;
+}
+
+reader_response MappedReader::RecordAt(size_t offset, record_view &record) const
+{
+	if (!data){
+		std::cout<<"File open fail"<<std::endl;
+		return ERROR;
+	}
+
+	if (offset + sizeof(SP_Devices_Monster_Data_Header) > size)
+		return END_FILE;
+
+	const SP_Devices_Monster_Data_Header *header = (const SP_Devices_Monster_Data_Header*) (data + offset);
+	const size_t record_size = sizeof(*header) + (size_t) header->nsamples*SP_BYTES_PER_SAMPLE;
+
+	// A truncated last record ends the file
+	if (offset + record_size > size)
+		return END_FILE;
+
+	record.header = header;
+	record.samples = (const int16_t*) (header + 1);
+	record.nsamples = header->nsamples;
+
+	return NO_ERROR;
+}
+
+reader_response MappedReader::NextRecord(record_view &record)
+{
+	reader_response res = RecordAt(cursor, record);
+	if (res != NO_ERROR)
+		return res;
+
+	cursor += sizeof(*record.header) + (size_t) record.nsamples*SP_BYTES_PER_SAMPLE;
+	return NO_ERROR;
+}
+
+reader_response MappedReader::NextRecord(record_view &record, int16_t *dst, uint32_t dst_samples)
+{
+	reader_response res = NextRecord(record);
+	if (res != NO_ERROR)
+		return res;
+
+	CopySamples(record, dst, dst_samples);
+	return NO_ERROR;
+}
+
+void MappedReader::CopySamples(const record_view &record, int16_t *dst, uint32_t dst_samples)
+{
+	const uint32_t n = record.nsamples < dst_samples ? record.nsamples : dst_samples;
+	memcpy(dst, record.samples, n*SP_BYTES_PER_SAMPLE);
+	for (uint32_t i = n; i < dst_samples; i++)
+		dst[i] = record.header->moving_average;
+}
+
+void MappedReader::Rewind()
+{
+	cursor = sizeof(SP_Devices_DataBlock_Information);
+}
+
+size_t MappedReader::Tell() const
+{
+	return cursor;
+}
+
+reader_response MappedReader::Seek(size_t offset)
+{
+	if (offset > size)
+		return ERROR;
+	cursor = offset;
+	return NO_ERROR;
+}
+
+size_t MappedReader::Size() const
+{
+	return size;
+}
@@ -40,4 +40,49 @@ private:
     std::ifstream file;
 };
 
+// View of one record inside a mapped file: no copies, valid while the reader lives
+struct record_view
+{
+    const SP_Devices_Monster_Data_Header *header;
+    const int16_t *samples;
+    uint32_t nsamples;
+};
+
+// Reader backend that maps the whole file and walks it record by record
+class MappedReader
+{
+public:
+    MappedReader(std::string &filename);
+    virtual ~MappedReader();
+
+    reader_response ReadCardHeader(SP_Devices_DataBlock_Information &card_header);
+
+    // Views the record at the cursor and moves the cursor past it
+    reader_response NextRecord(record_view &record);
+
+    // Views the record at a file offset, leaving the cursor alone; safe from several threads
+    reader_response RecordAt(size_t offset, record_view &record) const;
+
+    // Same, also copying the samples into dst (e.g. a mapped device buffer).
+    // Exactly dst_samples are written: short records are padded with the
+    // record moving average and long ones truncated.
+    reader_response NextRecord(record_view &record, int16_t *dst, uint32_t dst_samples);
+
+    // Copies exactly dst_samples samples of a record, padded or truncated as NextRecord does
+    static void CopySamples(const record_view &record, int16_t *dst, uint32_t dst_samples);
+
+    void Rewind();
+
+    // File offset of the next record, and random access to a record offset
+    size_t Tell() const;
+    reader_response Seek(size_t offset);
+
+    size_t Size() const;
+private:
+    int fd;
+    const char *data;
+    size_t size;
+    size_t cursor;
+};
+
 #endif /* READER_H_ */
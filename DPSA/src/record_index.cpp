@@ -0,0 +1,159 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#include "record_index.h"
+
+#include <algorithm>
+#include <sys/stat.h>
+
+static const char INDEX_MAGIC[8] = {'D','P','S','A','I','D','X','\0'};
+static const unsigned int INDEX_VERSION = 1;
+
+// The sidecar is only valid for the exact data file it was built from
+struct record_index_header
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int entry_size;
+    unsigned long long file_size;
+    long long file_mtime;
+    unsigned long long nrecords;
+};
+
+static bool file_stat(std::string &filename, unsigned long long &size, long long &mtime)
+{
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
+RecordIndex::RecordIndex() : sorted(true) {
+}
+
+RecordIndex::~RecordIndex() {
+}
+
+reader_response RecordIndex::Open(std::string &filename, MappedReader &reader)
+{
+	std::string index_file = filename + ".idx";
+	if (Load(index_file, filename) == NO_ERROR)
+		return NO_ERROR;
+
+	reader_response res = Build(reader);
+	if (res != NO_ERROR)
+		return res;
+
+	if (Save(index_file, filename) != NO_ERROR)
+		std::cout << "WARNING: could not write record index " << index_file << std::endl;
+	return NO_ERROR;
+}
+
+reader_response RecordIndex::Build(MappedReader &reader)
+{
+	entries.clear();
+	sorted = true;
+
+	SP_Devices_DataBlock_Information card_header;
+	reader_response res = reader.ReadCardHeader(card_header);
+	if (res != NO_ERROR)
+		return res;
+
+	// Only the headers are touched; the cursor follows each record's nsamples
+	record_view record;
+	size_t offset = reader.Tell();
+	while ((res = reader.NextRecord(record)) == NO_ERROR) {
+		record_index_entry e = {};
+		e.offset = offset;
+		e.timestamp = record.header->timestamp;
+		e.nsamples = record.nsamples;
+		e.channel = record.header->channel;
+		if (!entries.empty() && e.timestamp < entries.back().timestamp)
+			sorted = false;
+		entries.push_back(e);
+		offset = reader.Tell();
+	}
+
+	reader.Rewind();
+	return res == END_FILE ? NO_ERROR : res;
+}
+
+reader_response RecordIndex::Load(std::string &index_file, std::string &filename)
+{
+	record_index_header h;
+	unsigned long long file_size, index_size;
+	long long file_mtime, index_mtime;
+
+	if (!file_stat(filename, file_size, file_mtime) || !file_stat(index_file, index_size, index_mtime))
+		return ERROR;
+
+	std::ifstream file(index_file, std::ios::binary);
+	if (!file.is_open())
+		return ERROR;
+
+	file.read((char*) &h, sizeof(h));
+	if (file.fail() || memcmp(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+			h.version != INDEX_VERSION || h.entry_size != sizeof(record_index_entry) ||
+			h.file_size != file_size || h.file_mtime != file_mtime)
+		return ERROR;
+	// The entries must be exactly what follows the header, whatever nrecords says
+	if (index_size < sizeof(h) || h.nrecords != (index_size - sizeof(h)) / sizeof(record_index_entry) ||
+			(index_size - sizeof(h)) % sizeof(record_index_entry) != 0)
+		return ERROR;
+
+	entries.resize(h.nrecords);
+	file.read((char*) entries.data(), h.nrecords*sizeof(record_index_entry));
+	if (file.fail()) {
+		entries.clear();
+		return ERROR;
+	}
+
+	sorted = true;
+	for (size_t i = 1; i < entries.size() && sorted; i++)
+		sorted = entries[i].timestamp >= entries[i - 1].timestamp;
+	return NO_ERROR;
+}
+
+reader_response RecordIndex::Save(std::string &index_file, std::string &filename)
+{
+	record_index_header h;
+	memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	h.version = INDEX_VERSION;
+	h.entry_size = sizeof(record_index_entry);
+	h.nrecords = entries.size();
+	if (!file_stat(filename, h.file_size, h.file_mtime))
+		return ERROR;
+
+	std::ofstream file(index_file, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+		return ERROR;
+
+	file.write((const char*) &h, sizeof(h));
+	file.write((const char*) entries.data(), entries.size()*sizeof(record_index_entry));
+	return file.fail() ? ERROR : NO_ERROR;
+}
+
+size_t RecordIndex::Size() const
+{
+	return entries.size();
+}
+
+const record_index_entry &RecordIndex::operator[](size_t nrecord) const
+{
+	return entries[nrecord];
+}
+
+bool RecordIndex::Sorted() const
+{
+	return sorted;
+}
+
+size_t RecordIndex::Find(long long timestamp) const
+{
+	return std::lower_bound(entries.begin(), entries.end(), timestamp,
+			[](const record_index_entry &e, long long t) { return e.timestamp < t; }) - entries.begin();
+}
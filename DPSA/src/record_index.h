@@ -0,0 +1,54 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#ifndef RECORD_INDEX_H_
+#define RECORD_INDEX_H_
+
+#include <string>
+#include <vector>
+
+#include "reader.h"
+
+// One entry per record: 24 bytes, so a run of millions of records stays small
+struct record_index_entry
+{
+    unsigned long long offset;  // File offset of the record header
+    long long timestamp;
+    unsigned int nsamples;
+    char channel;
+    char pad[3];
+};
+
+/*
+ * Offset index of a monster file. It is built in one pass over the record
+ * headers and persisted next to the data file (<file>.idx), so later runs
+ * get O(1) access by record number and binary search by timestamp.
+ */
+class RecordIndex
+{
+public:
+    RecordIndex();
+    virtual ~RecordIndex();
+
+    // Loads the sidecar of filename if it is up to date, otherwise scans and writes it
+    reader_response Open(std::string &filename, MappedReader &reader);
+
+    reader_response Build(MappedReader &reader);
+    reader_response Load(std::string &index_file, std::string &filename);
+    reader_response Save(std::string &index_file, std::string &filename);
+
+    size_t Size() const;
+    const record_index_entry &operator[](size_t nrecord) const;
+
+    // True if timestamps never decrease, which Find relies on
+    bool Sorted() const;
+    // First record with a timestamp not below timestamp
+    size_t Find(long long timestamp) const;
+private:
+    std::vector<record_index_entry> entries;
+    bool sorted;
+};
+
+#endif /* RECORD_INDEX_H_ */
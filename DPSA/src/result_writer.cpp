@@ -0,0 +1,263 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#include "result_writer.h"
+#include "coincidence.h"
+
+#include <iostream>
+#include <math.h>
+#include <unistd.h>
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+
+// Output buffer, written out when less than a full record of room is left
+static const size_t WRITE_BUFFER = 1 << 20;
+static const size_t MAX_LINE = 32 + RESULT_MAX_PEAKS*(RESULT_FIELDS*16 + 24);
+static const size_t MAX_BINARY = sizeof(result_record) + RESULT_MAX_PEAKS*sizeof(result_signal);
+
+static const int WRITER_POLL = 100; // Idle writer thread sleep [us]
+
+static char * put_uint(char * p, uint64_t value)
+{
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	while (n)
+		*p++ = digits[--n];
+	return p;
+}
+
+static char * put_int(char * p, long long value)
+{
+	if (value < 0) {
+		*p++ = '-';
+		return put_uint(p, -(uint64_t)value);
+	}
+	return put_uint(p, value);
+}
+
+// Same text as std::cout << float with the default precision (%g)
+static char * put_float(char * p, float value)
+{
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+	return std::to_chars(p, p + 16, value, std::chars_format::general, 6).ptr;
+#else
+	return p + snprintf(p, 16, "%g", value);
+#endif
+}
+
+ResultWriter::ResultWriter(size_t ring_size) : fp(NULL), format(OUTPUT_CSV), units(), channel(0), continuous(false), position(0),
+		builder(NULL), ring(ring_size), closing(false), buffer(WRITE_BUFFER), used(0) {
+}
+
+ResultWriter::~ResultWriter() {
+	Close();
+}
+
+int ResultWriter::Open(std::string &filename, output_format format, const result_file_header &header)
+{
+	this->format = format;
+	units = header.units;
+	channel = header.channel;
+	continuous = header.continuous != 0;
+	position = 0;
+	used = 0;
+
+	if (format == OUTPUT_CSV) {
+		fp = fopen(filename.c_str(), "w");
+		if (!fp)
+			return -1;
+	} else {
+		fp = fopen(filename.c_str(), "wb");
+		if (!fp)
+			return -1;
+
+		result_file_header h = header;
+		memcpy(h.magic, RESULT_MAGIC, sizeof(h.magic));
+		h.version = RESULT_VERSION;
+		h.header_size = sizeof(result_file_header);
+		h.record_size = sizeof(result_record);
+		h.signal_size = sizeof(result_signal);
+		memcpy(buffer.data(), &h, sizeof(h));
+		used = sizeof(h);
+	}
+	// The writer thread does its own buffering
+	setvbuf(fp, NULL, _IONBF, 0);
+
+	closing.store(false);
+	writer = std::thread(&ResultWriter::Run, this);
+	return 0;
+}
+
+void ResultWriter::Attach(CoincidenceBuilder *builder)
+{
+	this->builder = builder;
+}
+
+void ResultWriter::Write(const float *data_r, const int *baseline, uint32_t index, long long timestamp, long long recordstart)
+{
+	result_block * block;
+	while ((block = ring.Claim()) == NULL)
+		std::this_thread::yield();
+
+	int npeaks = data_r[NPEAKS];
+	if (npeaks < 0 || npeaks > RESULT_MAX_PEAKS)
+		npeaks = npeaks < 0 ? 0 : RESULT_MAX_PEAKS;
+	memcpy(block->data, data_r, (npeaks ? npeaks*RESULT_FIELDS : RESULT_FIELDS)*sizeof(float));
+	block->data[NPEAKS] = npeaks;
+	block->baseline = baseline[BS];
+	block->index = index;
+	block->timestamp = timestamp;
+	block->recordstart = recordstart;
+	ring.Publish();
+}
+
+void ResultWriter::Convert(result_block *blocks, size_t n, const output_units &u)
+{
+	// Every field is (x + pre) * mul - post, so the inner loop has no branches
+	float mul[RESULT_FIELDS] = {1, 1, 1, u.FS, u.FS, u.SampleRate_1};
+	// pre is -0 so that x + pre keeps the sign of a zero x
+	float pre[RESULT_FIELDS];
+	float post[RESULT_FIELDS] = {0};
+	for (int i = 0; i < RESULT_FIELDS; i++)
+		pre[i] = -0.f;
+	for (int i = ENERGY; i < PSD; i++)
+		mul[i] = u.FS;
+	mul[PSD] = 1;
+	mul[PARTICLE] = 1;
+	post[BASELINE] = u.offset;
+	post[PTIME] = u.PreTrigger_Delay;
+
+	for (size_t b = 0; b < n; b++) {
+		result_block & block = blocks[b];
+		pre[BASELINE] = block.baseline;
+		const int npeaks = block.data[NPEAKS];
+		// The kernel time counts samples from the first one of the record, so the
+		// event is at the record timestamp plus recordstart plus that time
+		const long long start = (block.timestamp + block.recordstart) * (1LL << EVENT_TIME_FRACTION);
+		for (int peak = 0; peak < npeaks; ++peak) {
+			float * r = block.data + peak*RESULT_FIELDS;
+			// A flat CFD at the zero crossing leaves the time undefined
+			block.time[peak] = start + (isfinite(r[PTIME]) ? llroundf(r[PTIME] * (1 << EVENT_TIME_FRACTION)) : 0);
+			for (int i = 0; i < RESULT_FIELDS; i++)
+				r[i] = (r[i] + pre[i]) * mul[i] - post[i];
+		}
+	}
+}
+
+void ResultWriter::FormatCsv(const result_block &block)
+{
+	char * p = buffer.data() + used;
+	p = put_uint(p, block.index);
+	*p++ = ',';
+	// Pulses of the continuous stream go with their sample
+	if (continuous) {
+		p = put_uint(p, block.timestamp);
+		*p++ = ',';
+	}
+	const int npeaks = block.data[NPEAKS];
+	// Every pulse ends with its event time
+	for (int peak = 0; peak < npeaks; peak++) {
+		for (int i = 0; i < RESULT_FIELDS; i++) {
+			p = put_float(p, block.data[peak*RESULT_FIELDS + i]);
+			*p++ = ',';
+		}
+		p = put_int(p, block.time[peak]);
+		*p++ = ',';
+	}
+	*p++ = '\n';
+	used = p - buffer.data();
+}
+
+void ResultWriter::FormatBinary(const result_block &block)
+{
+	const int npeaks = block.data[NPEAKS];
+
+	result_record record = {};
+	record.nrecord = block.index;
+	record.nsignals = npeaks;
+	record.baseline = npeaks ? block.data[BASELINE] : block.baseline * units.FS - units.offset;
+	record.stdbaseline = npeaks ? block.data[STDBASELINE] : 0;
+	record.timestamp = block.timestamp;
+	record.recordstart = block.recordstart;
+	record.position = position;
+	record.channel = channel;
+	memcpy(buffer.data() + used, &record, sizeof(record));
+	used += sizeof(record);
+
+	for (int peak = 0; peak < npeaks; ++peak) {
+		const float * r = block.data + peak*RESULT_FIELDS;
+		result_signal signal = {};
+		signal.pileup = r[PILEUP];
+		signal.saturated = r[SATURED];
+		signal.nsignal = r[NPEAKS];
+		signal.baseline = r[BASELINE];
+		signal.stdbaseline = r[STDBASELINE];
+		signal.time = r[PTIME];
+		signal.event_time = block.time[peak];
+		for (int i = ENERGY; i < PSD; i++)
+			signal.energy[i - ENERGY] = r[i];
+		signal.psd = r[PSD];
+		signal.particle = r[PARTICLE];
+		memcpy(buffer.data() + used, &signal, sizeof(signal));
+		used += sizeof(signal);
+	}
+	position += npeaks;
+}
+
+void ResultWriter::Flush()
+{
+	if (used && fwrite(buffer.data(), 1, used, fp) != used)
+		std::cerr << "WARNING: could not write results" << std::endl;
+	used = 0;
+}
+
+void ResultWriter::Run()
+{
+	const size_t room = format == OUTPUT_CSV ? MAX_LINE : MAX_BINARY;
+	for (;;) {
+		result_block * blocks;
+		const size_t n = ring.Peek(blocks);
+		if (n == 0) {
+			if (closing.load(std::memory_order_acquire) && ring.Peek(blocks) == 0)
+				break;
+			// Nothing queued: write out what is buffered while waiting
+			Flush();
+			usleep(WRITER_POLL);
+			continue;
+		}
+
+		Convert(blocks, n, units);
+		for (size_t b = 0; b < n; b++) {
+			if (builder)
+				builder->Push(channel, blocks[b]);
+			if (buffer.size() - used < room)
+				Flush();
+			if (format == OUTPUT_CSV)
+				FormatCsv(blocks[b]);
+			else
+				FormatBinary(blocks[b]);
+		}
+		ring.Release(n);
+	}
+	Flush();
+	if (builder)
+		builder->Finish(channel);
+}
+
+void ResultWriter::Close()
+{
+	if (writer.joinable()) {
+		closing.store(true, std::memory_order_release);
+		writer.join();
+	}
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+}
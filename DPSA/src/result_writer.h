@@ -0,0 +1,192 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#ifndef RESULT_WRITER_H_
+#define RESULT_WRITER_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dpsa_defines.h"
+#include "spsc_ring.h"
+
+// Kernel result fields
+#define PILEUP 0
+#define SATURED 1 // Clipped samples in the window of the pulse
+#define NPEAKS 2
+#define BASELINE 3
+#define STDBASELINE 4
+#define PTIME 5
+#define ENERGY 6 // One field per config.ini energy window
+#define PSD (ENERGY + MAX_ENERGY_CALCULATIONS) // Tail/total charge
+#define PARTICLE (PSD + 1)
+
+// Per record kernel arguments
+#define BS 0
+#define OF 1
+
+// Energy window table of the kernels: {method, from, to} per energy, NO_ENERGY when inactive
+#define WINDOW_METHOD 0
+#define WINDOW_FROM 1
+#define WINDOW_TO 2
+#define WINDOW_ARGS 3
+#define NO_ENERGY -1
+
+// PSD table of the kernels: the tail and total energies, NO_ENERGY without PSD, the particle
+// kept, and the cut as points of total energy (kernel units) and ratio
+#define PSD_TAIL 0
+#define PSD_TOTAL 1
+#define PSD_KEEP 2
+#define PSD_POINTS 3
+#define PSD_CUT_ENERGY 4
+#define PSD_CUT_RATIO (PSD_CUT_ENERGY + MAX_PSD_POINTS)
+#define PSD_ARGS (PSD_CUT_RATIO + MAX_PSD_POINTS)
+
+#define RESULT_FIELDS (PARTICLE + 1)
+#define RESULT_MAX_PEAKS 10
+
+// Event times are fixed point sample clock ticks with this many fraction bits
+#define EVENT_TIME_FRACTION 8
+
+class CoincidenceBuilder;
+
+// Conversion from kernel units (ADC units, samples) to physical units
+struct output_units {
+	float FS;
+	float offset;
+	float SampleRate_1;
+	int PreTrigger_Delay;
+};
+
+// Raw kernel results of one record, as queued for the writer thread
+struct result_block {
+	float data[RESULT_MAX_PEAKS*RESULT_FIELDS];
+	int baseline;
+	uint32_t index;
+	long long timestamp;
+	long long recordstart;
+	long long time[RESULT_MAX_PEAKS];	// Absolute event times, filled in by Convert
+};
+
+enum output_format
+{
+    OUTPUT_CSV,
+    OUTPUT_BINARY
+};
+
+static const char RESULT_MAGIC[8] = {'D','P','S','A','R','E','S','\0'};
+static const unsigned int RESULT_VERSION = 7;
+
+// Record of a binary result file: SIMPLE_Record_Results, with room for the whole recordstart
+struct result_record
+{
+    unsigned int nrecord;
+    unsigned int nsignals;
+    float baseline;
+    float stdbaseline;
+    long long timestamp;
+    long long recordstart;
+    unsigned int position;
+    unsigned short channel;
+};
+
+// Signal of a binary result file: the fields of SIMPLE_Signal_Results, then those of this analysis
+struct result_signal
+{
+    short pileup;
+    short saturated;
+    unsigned int nsignal;
+    float baseline;
+    float stdbaseline;
+    double time;
+    double energy[MAX_ENERGY_CALCULATIONS];
+    float psd;
+    int particle;
+    long long event_time;
+};
+
+/*
+ * Binary result file: one result_file_header, then for every record a
+ * result_record followed by its nsignals result_signal.
+ * Values are already in physical units; energy[] holds the config.ini energies,
+ * saturated the clipped samples in the window of the signal and psd and
+ * particle its pulse shape, and event_time adds the record timestamp and
+ * recordstart to the time of the signal. In continuous files every record is
+ * one pulse of krnl_dpsa_continuous, its timestamp the index of the pulse
+ * sample in the stream and its time the offset of the zero crossing from
+ * that sample.
+ */
+struct result_file_header
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int header_size;
+    unsigned int record_size;   // sizeof(result_record)
+    unsigned int signal_size;   // sizeof(result_signal)
+    // Units
+    output_units units;
+    // Analysis configuration
+    float threshold;            // ADC units
+    float cfd_factor;
+    float rc;
+    float rc_scale;
+    unsigned int channel;
+    unsigned int nsamples;
+    unsigned int continuous;    // Records are single pulses of the continuous stream
+    char input_file[192];
+};
+
+/*
+ * Output stage. Write() only copies the raw results into a lock-free ring;
+ * a writer thread converts them to physical units in batches, formats them
+ * into a large buffer and writes the file, off the thread driving the FPGA.
+ */
+class ResultWriter
+{
+public:
+    ResultWriter(size_t ring_size);
+    virtual ~ResultWriter();
+
+    // Binary writes the header first; every channel has its own writer and file
+    int Open(std::string &filename, output_format format, const result_file_header &header);
+
+    // Pulses also go to the coincidence builder, as events of the writer channel
+    void Attach(CoincidenceBuilder *builder);
+
+    // Queues the kernel results of one record, waiting while the ring is full; a pulse
+    // of the continuous stream is a record with the pulse sample as its timestamp
+    void Write(const float *data_r, const int *baseline, uint32_t index, long long timestamp, long long recordstart);
+
+    // Writes everything queued and closes the file
+    void Close();
+
+    // Kernel units to physical units, for n records at once; the event times
+    // are taken from the kernel times first
+    static void Convert(result_block *blocks, size_t n, const output_units &u);
+private:
+    void Run();
+    void FormatCsv(const result_block &block);
+    void FormatBinary(const result_block &block);
+    void Flush();
+
+    FILE *fp;
+    output_format format;
+    output_units units;
+    unsigned short channel;
+    bool continuous;
+    unsigned int position;
+    CoincidenceBuilder *builder;
+
+    SpscRing<result_block> ring;
+    std::thread writer;
+    std::atomic<bool> closing;
+    std::vector<char> buffer;
+    size_t used;
+};
+
+#endif /* RESULT_WRITER_H_ */
@@ -0,0 +1,73 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Lock-free single producer / single consumer ring of fixed-size slots.
+ * The producer fills a slot in place (Claim, Publish) and the consumer
+ * works on the contiguous run of published slots (Peek, Release), so
+ * nothing is copied twice and nothing is allocated after construction.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity) : head(0), tail(0), head_cache(0), tail_cache(0) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Producer: free slot to fill, NULL if the ring is full
+    T *Claim() {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail_cache > mask) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h - tail_cache > mask)
+                return NULL;
+        }
+        return &slots[h & mask];
+    }
+
+    // Producer: makes the claimed slot visible to the consumer
+    void Publish() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: number of published slots readable from first without wrapping
+    size_t Peek(T *&first) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (head_cache == t)
+            head_cache = head.load(std::memory_order_acquire);
+        const size_t available = head_cache - t;
+        const size_t to_end = slots.size() - (t & mask);
+        first = &slots[t & mask];
+        return available < to_end ? available : to_end;
+    }
+
+    // Consumer: hands n slots back to the producer
+    void Release(size_t n) {
+        tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    size_t Capacity() const { return slots.size(); }
+private:
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;   // Written by the producer only
+    alignas(64) std::atomic<size_t> tail;   // Written by the consumer only
+    alignas(64) size_t head_cache;          // Consumer copy of head
+    alignas(64) size_t tail_cache;          // Producer copy of tail
+};
+
+#endif /* SPSC_RING_H_ */
@@ -8,25 +8,147 @@
 #include <ap_axi_sdata.h>
 
 #define DATA_SIZE 375
+#define MAX_BATCH 64
 
 typedef ap_uint<128> uint128_t;
+// Eight samples of a converter, first in the least significant bits, TLAST on the last beat of a record
+typedef ap_axiu<128, 1, 0, 0> wide_axis;
 
 // TRIPCOUNT identifier
 const int c_size = DATA_SIZE;
 
+/*
+ * JESD204B transport layer of krnl_JESD204B_rx_stream, set with -DJESD_L= etc.
+ * in the kernel compiler options. The L lanes share the 128-bit beat, 128/L
+ * bits each, first octet in the least significant bits. A frame is F octets
+ * of every lane, lane 0 first, and holds FRAME_SAMPLES samples of each of the
+ * M converters, converter 0 first. Samples are NP bits (12 or 16) from the
+ * least significant bit of the frame; their N most significant bits are the
+ * conversion and the rest control and tail bits. The defaults are the single
+ * converter, 16-bit layout that krnl_JESD204B_tx emulates.
+ */
+#ifndef JESD_L
+#define JESD_L 1
+#endif
+#ifndef JESD_M
+#define JESD_M 1
+#endif
+#ifndef JESD_F
+#define JESD_F 2
+#endif
+#ifndef JESD_N
+#define JESD_N 16
+#endif
+#ifndef JESD_NP
+#define JESD_NP 16
+#endif
+
+#define MAX_CONVERTERS 4
+#define BEAT_OCTETS 16
+#define LANE_OCTETS (BEAT_OCTETS/JESD_L)
+#define FRAME_OCTETS (JESD_F*JESD_L)
+#define FRAME_SAMPLES (8*FRAME_OCTETS/(JESD_M*JESD_NP))
+
+static_assert(JESD_L == 1 || JESD_L == 2 || JESD_L == 4, "JESD_L lanes must split the beat evenly");
+static_assert(JESD_M >= 1 && JESD_M <= MAX_CONVERTERS, "JESD_M must be 1 to MAX_CONVERTERS");
+static_assert(JESD_F >= 1 && JESD_F <= LANE_OCTETS, "a JESD_F octet frame must fit in the lane octets of a beat");
+static_assert(JESD_NP == 12 || JESD_NP == 16, "JESD_NP must be 12 or 16");
+static_assert(JESD_N >= 8 && JESD_N <= JESD_NP, "JESD_N must fit in JESD_NP");
+static_assert(FRAME_SAMPLES >= 1 && 8*FRAME_OCTETS == FRAME_SAMPLES*JESD_M*JESD_NP, "frames must hold whole samples of every converter");
+
+/*
+ * krnl_JESD204B_rx_stream_wide takes a beat per cycle, so it is only built for
+ * layouts whose frames do not straddle beats and whose beats hold a whole
+ * fraction of eight samples of every converter: the 16-bit layouts of 1, 2
+ * and 4 converters.
+ */
+#define BEAT_FRAMES (LANE_OCTETS/JESD_F)
+#define BEAT_SAMPLES (BEAT_FRAMES*FRAME_SAMPLES)
+#if LANE_OCTETS % JESD_F == 0 && 8 % BEAT_SAMPLES == 0
+#define JESD_WIDE 1
+#endif
+
+/*
+ * Takes the next frame out of the lane octets received but not framed yet,
+ * have per lane, reading a beat when they hold less than a frame
+ */
+static void next_frame(hls::stream<uint128_t> &inStream, ap_uint<8> octet[JESD_L][2*LANE_OCTETS], int &have, ap_uint<8> frame[FRAME_OCTETS])
+{
+#pragma HLS INLINE
+	if (have < JESD_F) {
+		uint128_t v = inStream.read();
+		for (int l = 0; l < JESD_L; l++)
+			for (int k = 0; k < LANE_OCTETS; k++)
+				octet[l][have + k] = v.range(8*(l*LANE_OCTETS + k) + 7, 8*(l*LANE_OCTETS + k));
+		have += LANE_OCTETS;
+	}
+	for (int l = 0; l < JESD_L; l++) {
+		for (int k = 0; k < JESD_F; k++)
+			frame[l*JESD_F + k] = octet[l][k];
+		for (int k = 0; k + JESD_F < 2*LANE_OCTETS; k++)
+			octet[l][k] = octet[l][k + JESD_F];
+	}
+	have -= JESD_F;
+}
+
+// Sample j of a frame as a 16-bit ADC code, its N bits aligned to the most significant bit
+static short frame_code(const ap_uint<8> frame[FRAME_OCTETS], int j)
+{
+#pragma HLS INLINE
+	const int bit = j*JESD_NP;
+	const int o = bit/8;
+	unsigned int w = 0;
+	for (int k = 0; k < 3; k++)
+		if (o + k < FRAME_OCTETS)
+			w |= (unsigned int)frame[o + k] << (8*k);
+	const unsigned int field = (w >> (bit % 8)) & ((1u << JESD_NP) - 1);
+	const unsigned int code = (field >> (JESD_NP - JESD_N)) << (16 - JESD_N);
+	return (short)code;
+}
+
+// Sample j of a frame framed for krnl_dpsa_stream
+static ap_axis<16, 1, 0, 0> frame_sample(const ap_uint<8> frame[FRAME_OCTETS], int j, bool first, bool last)
+{
+#pragma HLS INLINE
+	ap_axis<16, 1, 0, 0> v;
+	v.data = frame_code(frame, j);
+	v.keep = -1;
+	v.strb = -1;
+	v.user = first;
+	v.last = last;
+	return v;
+}
+
+#ifdef JESD_WIDE
+// Eight held samples of a converter as a beat of krnl_dpsa_stream_wide
+static wide_axis wide_beat(const short held[8], bool first, bool last)
+{
+#pragma HLS INLINE
+	wide_axis v;
+	for (int i = 0; i < 8; i++)
+		v.data.range(16*i + 15, 16*i) = (unsigned short)held[i];
+	v.keep = -1;
+	v.strb = -1;
+	v.user = first;
+	v.last = last;
+	return v;
+}
+#endif
+
 extern "C" {
 	void krnl_JESD204B_rx(
 			hls::stream<uint128_t> &inStream,
 			hls::stream<ap_axis<16, 0, 0, 0> > &outStream_ln0,
-			short size
+			short size,
+			short nrecords
 			){
 
 #pragma HLS INTERFACE axis port=inStream depth=2048
 #pragma HLS dataflow
 
-		for (int i = 0; i < size; i++){
+		for (int i = 0; i < size*nrecords; i++){
 
-#pragma HLS LOOP_TRIPCOUNT min = c_size max = c_size
+#pragma HLS LOOP_TRIPCOUNT min = c_size max = c_size*MAX_BATCH
 
 			uint128_t v = inStream.read();
 
@@ -60,4 +182,154 @@ extern "C" {
 
 		}
 	}
+
+	/*
+	 * Free-running variant, launched once. The JESD204B frames are split into one
+	 * sample stream per converter, outStream_ln<m> for converter m, and each stream
+	 * is framed into records of 8*size samples: TUSER flags the first sample of every
+	 * record and TLAST the last one. Converters without their bit in converters are
+	 * dropped, so their streams may be left unconnected at run time. records = 0 runs
+	 * forever. Every stream gets one sample per cycle.
+	 */
+	void krnl_JESD204B_rx_stream(
+			hls::stream<uint128_t> &inStream,
+			short size,
+			unsigned int records,
+			unsigned int converters,
+			hls::stream<ap_axis<16, 1, 0, 0> > &outStream_ln0
+#if JESD_M > 1
+			, hls::stream<ap_axis<16, 1, 0, 0> > &outStream_ln1
+#endif
+#if JESD_M > 2
+			, hls::stream<ap_axis<16, 1, 0, 0> > &outStream_ln2
+#endif
+#if JESD_M > 3
+			, hls::stream<ap_axis<16, 1, 0, 0> > &outStream_ln3
+#endif
+			){
+
+#pragma HLS INTERFACE axis port=inStream depth=2048
+
+		const int record_samples = 8*size;
+		ap_uint<8> octet[JESD_L][2*LANE_OCTETS];
+#pragma HLS ARRAY_PARTITION variable=octet complete dim=0
+		int have = 0;
+		int sample = 0;
+		unsigned int r = 0;
+
+		while (records == 0 || r < records){
+#pragma HLS PIPELINE II=FRAME_SAMPLES
+#pragma HLS LOOP_TRIPCOUNT min = c_size*8/FRAME_SAMPLES max = c_size*8/FRAME_SAMPLES
+
+			ap_uint<8> frame[FRAME_OCTETS];
+#pragma HLS ARRAY_PARTITION variable=frame complete
+			next_frame(inStream, octet, have, frame);
+
+			for (int s = 0; s < FRAME_SAMPLES; s++){
+				const bool first = sample == 0;
+				const bool last = sample == record_samples - 1;
+				if (records == 0 || r < records){
+					if (converters & 1)
+						outStream_ln0 << frame_sample(frame, s, first, last);
+#if JESD_M > 1
+					if (converters & 2)
+						outStream_ln1 << frame_sample(frame, FRAME_SAMPLES + s, first, last);
+#endif
+#if JESD_M > 2
+					if (converters & 4)
+						outStream_ln2 << frame_sample(frame, 2*FRAME_SAMPLES + s, first, last);
+#endif
+#if JESD_M > 3
+					if (converters & 8)
+						outStream_ln3 << frame_sample(frame, 3*FRAME_SAMPLES + s, first, last);
+#endif
+				}
+				sample = last ? 0 : sample + 1;
+				if (last)
+					r++;
+			}
+		}
+	}
+
+#ifdef JESD_WIDE
+	/*
+	 * krnl_JESD204B_rx_stream for krnl_dpsa_stream_wide and krnl_dpsa_continuous_wide.
+	 * A beat is read every cycle and the samples of each converter are gathered
+	 * into beats of eight, first in the least significant bits, so that records
+	 * of 8*size samples are size beats: TUSER flags the first beat of every record
+	 * and TLAST the last one.
+	 */
+	void krnl_JESD204B_rx_stream_wide(
+			hls::stream<uint128_t> &inStream,
+			short size,
+			unsigned int records,
+			unsigned int converters,
+			hls::stream<wide_axis> &outStream_ln0
+#if JESD_M > 1
+			, hls::stream<wide_axis> &outStream_ln1
+#endif
+#if JESD_M > 2
+			, hls::stream<wide_axis> &outStream_ln2
+#endif
+#if JESD_M > 3
+			, hls::stream<wide_axis> &outStream_ln3
+#endif
+			){
+
+#pragma HLS INTERFACE axis port=inStream depth=2048
+
+		short held[JESD_M][8];
+#pragma HLS ARRAY_PARTITION variable=held complete dim=0
+		int fill = 0;
+		int beat = 0;
+		unsigned int r = 0;
+
+		while (records == 0 || r < records){
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = c_size*BEAT_SAMPLES/8 max = c_size*BEAT_SAMPLES/8
+
+			uint128_t v = inStream.read();
+			short x[JESD_M][BEAT_SAMPLES];
+#pragma HLS ARRAY_PARTITION variable=x complete dim=0
+			for (int f = 0; f < BEAT_FRAMES; f++){
+				ap_uint<8> frame[FRAME_OCTETS];
+#pragma HLS ARRAY_PARTITION variable=frame complete
+				for (int l = 0; l < JESD_L; l++)
+					for (int k = 0; k < JESD_F; k++)
+						frame[l*JESD_F + k] = v.range(8*(l*LANE_OCTETS + f*JESD_F + k) + 7, 8*(l*LANE_OCTETS + f*JESD_F + k));
+				for (int m = 0; m < JESD_M; m++)
+					for (int s = 0; s < FRAME_SAMPLES; s++)
+						x[m][f*FRAME_SAMPLES + s] = frame_code(frame, m*FRAME_SAMPLES + s);
+			}
+			// Shifted down, the samples of this beat taking the top
+			for (int m = 0; m < JESD_M; m++)
+				for (int i = 0; i < 8; i++)
+					held[m][i] = i + BEAT_SAMPLES < 8 ? held[m][i + BEAT_SAMPLES] : x[m][i + BEAT_SAMPLES - 8];
+			fill += BEAT_SAMPLES;
+
+			if (fill == 8){
+				const bool first = beat == 0;
+				const bool last = beat == size - 1;
+				if (converters & 1)
+					outStream_ln0 << wide_beat(held[0], first, last);
+#if JESD_M > 1
+				if (converters & 2)
+					outStream_ln1 << wide_beat(held[1], first, last);
+#endif
+#if JESD_M > 2
+				if (converters & 4)
+					outStream_ln2 << wide_beat(held[2], first, last);
+#endif
+#if JESD_M > 3
+				if (converters & 8)
+					outStream_ln3 << wide_beat(held[3], first, last);
+#endif
+				fill = 0;
+				beat = last ? 0 : beat + 1;
+				if (last)
+					r++;
+			}
+		}
+	}
+#endif
 }
@@ -15,6 +15,7 @@ Description:
 typedef ap_uint<128> uint128_t;
 
 #define DATA_SIZE 375
+#define MAX_BATCH 64
 
 // TRIPCOUNT identifier
 const int c_size = DATA_SIZE;
@@ -23,15 +24,16 @@ extern "C" {
 	void krnl_JESD204B_tx(
 			hls::stream<uint128_t> &outStream,
 			uint128_t * in,
-			short size
+			short size,
+			short nrecords
 			){
 
 #pragma HLS INTERFACE m_axi port=in offset=slave bundle=gmem0
 #pragma HLS INTERFACE axis port=outStream
 
-		/*Write to AXIS*/
-		for(int i = 0; i < size; i++){
-#pragma HLS LOOP_TRIPCOUNT min = c_size max = c_size
+		/*Write to AXIS: nrecords records of size beats, packed back to back*/
+		for(int i = 0; i < size*nrecords; i++){
+#pragma HLS LOOP_TRIPCOUNT min = c_size max = c_size*MAX_BATCH
 			outStream << in[i];
 		}
 	}
@@ -30,21 +30,23 @@ template <class T>
 
 #define DATA_SIZE 3000
 #define FIR_N 20
-#define CHANNELS 3
-#define DELAY 10
-
-#define SLOPE -1
-
-#define RANGE_FROM 50
-#define RANGE_TO 300
-#define SIZE 350
 
 #define BS 0
 #define OF 1
 #define TH 2
+#define ARGS_SIZE 2
+
+#define MAX_BATCH 64
 
 #define MAX_PEAKS 10
-#define RESULT_SIZE 10
+#define ENERGIES 5
+#define RESULT_SIZE (PARTICLE + 1)
+
+// Shaping modes, must match SimpleDataProcess.h
+#define RC_SHAPING 0
+#define RC4_SHAPING 1
+#define RC_IIR_SHAPING 4
+#define IIR_STAGES 4
 
 #define PILEUP 0
 #define SATURED 1
@@ -52,338 +54,1774 @@ template <class T>
 #define BASELINE 3
 #define STDBASELINE 4
 #define PTIME 5
-#define MAX 6
-#define EN 7
-#define EN1 8
-#define EN2 9
+#define ENERGY 6
+#define PSD (ENERGY + ENERGIES)
+#define PARTICLE (PSD + 1)
+
+// Energy window table, ENERGIES x WINDOW_ARGS ints in the samples of config.ini
+#define WINDOW_METHOD 0
+#define WINDOW_FROM 1
+#define WINDOW_TO 2
+#define WINDOW_ARGS 3
+
+// Energy methods, must match SimpleDataProcess.h
+#define NO_ENERGY -1
+#define MAX_AMPLITUDE 0
+#define AREA 1
+#define RMS 2
+#define PEAK2PEAK 3
+
+// PSD table, PSD_ARGS floats: tail and total energies, particle kept, cut points. MAX_PSD_POINTS must match dpsa_defines.h
+#define MAX_PSD_POINTS 8
+#define PSD_TAIL 0
+#define PSD_TOTAL 1
+#define PSD_KEEP 2
+#define PSD_POINTS 3
+#define PSD_CUT_ENERGY 4
+#define PSD_CUT_RATIO (PSD_CUT_ENERGY + MAX_PSD_POINTS)
+#define PSD_ARGS (PSD_CUT_RATIO + MAX_PSD_POINTS)
+
+// Particles, must match dpsa_defines.h
+#define PARTICLE_NONE -1
+#define PARTICLE_GAMMA 0
+#define PARTICLE_NEUTRON 1
+
+// ADC codes of the rails; samples at or beyond them are clipped
+#ifndef ADC_RAIL_HIGH
+#define ADC_RAIL_HIGH 32767
+#endif
+#ifndef ADC_RAIL_LOW
+#define ADC_RAIL_LOW -32768
+#endif
 
 typedef ap_uint<128> uint128_t;
+// Framed beats of eight samples from krnl_JESD204B_rx_stream_wide, TLAST on the last of a record
+typedef ap_axiu<128, 1, 0, 0> wide_axis;
+
+/*
+ * Fixed point widths of krnl_dpsa_fixed. Samples relative to the baseline
+ * take 17 integer bits plus one of headroom for the shaping gain, the taps,
+ * the pole, the CFD factor and the scale stay below 4, and the energy sums
+ * grow by log2(RANGE_TO) bits. Override them with -D to build cheaper variants.
+ */
+#ifndef FIXED_SAMPLE_W
+#define FIXED_SAMPLE_W 24
+#endif
+#ifndef FIXED_COEF_W
+#define FIXED_COEF_W 18
+#endif
+#ifndef FIXED_ACC_W
+#define FIXED_ACC_W 40
+#endif
+#define FIXED_SAMPLE_I 18
+#define FIXED_COEF_I 3
+#define FIXED_ACC_I 28
+
+/*
+ * Datapath types. sample_t holds the baseline corrected, shaped and CFD
+ * signals, coef_t the filter coefficients, acc_t the FIR, IIR and energy
+ * sums. mac_t keeps the IIR sums of products exact until they are rounded
+ * to acc_t.
+ */
+struct dpsa_float
+{
+	typedef float sample_t;
+	typedef float coef_t;
+	typedef float acc_t;
+
+	typedef float mac_t;
 
-// TRIPCOUNT identifier
-const int c_size =SIZE;
+	static coef_t tap(float h, float) { return h; }
+	static acc_t normalise(acc_t sum, float h_sum) { return sum/h_sum; }
+};
 
-static void load_h_input(float* h, hls::vector<float,20>& hVector, float & h_sum, int size)
+// Taps are normalised once when loaded, so the FIR needs no division
+struct dpsa_fixed
 {
+	typedef ap_fixed<FIXED_SAMPLE_W, FIXED_SAMPLE_I, AP_RND, AP_SAT> sample_t;
+	typedef ap_fixed<FIXED_COEF_W, FIXED_COEF_I, AP_RND> coef_t;
+	typedef ap_fixed<FIXED_ACC_W, FIXED_ACC_I, AP_RND> acc_t;
+	typedef ap_fixed<FIXED_COEF_W + FIXED_ACC_W + 4, FIXED_COEF_I + FIXED_ACC_I + 4> mac_t;
+
+	static coef_t tap(float h, float h_sum) { return h/h_sum; }
+	static acc_t normalise(acc_t sum, float) { return sum; }
+};
+
+template <class T>
+static void load_h_input(float* h, hls::vector<typename T::coef_t,20>& hVector, float & h_sum, int size)
+{
+	float l_h[FIR_N];
 mem_h_rd:
     for (int i = 0; i < size; i++) {
-        hVector[i] = h[i];
+        l_h[i] = h[i];
         h_sum += h[i];
     }
+    for (int i = 0; i < size; i++) {
+        hVector[i] = T::tap(l_h[i], h_sum);
+    }
 }
 
-static void load_input(hls::stream<ap_axis<16, 0, 0, 0> > & in_stream, int * l_in, int baseline, short & npeaks, int * start_index, float threshold, short size)
+/*
+ * analyse_record is a dataflow of six stages connected by hls::stream, each
+ * pipelined at II=1 and handing one token per input beat to the next:
+ *
+ *   read_trigger -> window_baseline -> shape_signal -> compute_cfd -> zero_cross -> energy_integration
+ *
+ * energy_integration sends out the pulses in order, and record_results packs
+ * those of a record into its block of results; on the continuous stream of
+ * krnl_dpsa_continuous, store_events writes every pulse as it comes.
+ *
+ * Sample t of the record is x[t] = data - baseline for 0 <= t < size and 0
+ * elsewhere. A trigger at t opens the window [t - SIZE - RANGE_FROM, +WINDOW)
+ * and the stages delay the samples just enough to see the window they work
+ * on: compute_cfd runs WINDOW samples behind the input, so the window
+ * baseline is known when the window starts, and energy_integration another
+ * ENERGY_LAG samples behind, so the zero crossing is known before the
+ * energy range starts. A record takes max(size, last trigger + RECORD_TAIL)
+ * samples whatever the number of pulses.
+ *
+ * read_trigger keeps the prefix sums of x and x*x, and the tokens carry
+ * them instead of the samples once the signal is shaped: the sum of any
+ * window [a, b] is p[b] - p[a - 1], so the baseline and energy windows cost
+ * two captures and a subtraction each, not an accumulator per window.
+ *
+ * A beat, and so a token, holds N consecutive samples: one on the ap_axis
+ * streams of krnl_dpsa, eight on the 128-bit beats of krnl_dpsa_wide. Every
+ * stage runs its sample by sample logic on the N lanes of a token in the
+ * same cycle, so a record takes one cycle per N of those samples. The
+ * running sums and the IIR recurrences carry a single addition from beat to
+ * beat; the few per window results, the baseline and the pulse time, are
+ * computed once per beat after the lanes.
+ *
+ * The float IIR recurrence is bound by the latency of the float adder and
+ * only the fixed point datapath runs it at II=1.
+ */
+static constexpr int pow2_above(int n, int p = 1) { return p > n ? p : pow2_above(n, 2*p); }
+
+// Beats of N samples in a sample history of at least n samples, a power of two
+static constexpr int line_beats(int n, int N) { return pow2_above(n + N - 1)/N; }
+
+/*
+ * Analysis parameters. The window of a trigger holds two baseline regions
+ * of SIZE samples around the pulse, DELAY is the CFD delay and SLOPE the
+ * pulse polarity, -1 for negative pulses. The energy range starts RANGE_FROM
+ * samples before the zero crossing and ends RANGE_TO samples after its
+ * start; the energy windows of the host table are clamped to it. SPLINE
+ * selects the 4 point spline CFD time instead of the 2 point interpolation
+ * and REJECT drops the windows with clipped samples before their analysis.
+ */
+template <int SIZE_, int RANGE_FROM_, int RANGE_TO_, int DELAY_, int SLOPE_, int SPLINE_, int REJECT_>
+struct dpsa_params
 {
-#pragma HLS dataflow
+	static constexpr int SIZE = SIZE_;
+	static constexpr int RANGE_FROM = RANGE_FROM_;
+	static constexpr int RANGE_TO = RANGE_TO_;
+	static constexpr int DELAY = DELAY_;
+	static constexpr int SLOPE = SLOPE_;
+	static constexpr bool SPLINE = SPLINE_ != 0;
+	static constexpr bool REJECT = REJECT_ != 0;
+
+	static constexpr int WINDOW = 3*SIZE;
+	static constexpr int TRIGGER_LAG = SIZE + RANGE_FROM;
+	// Last sample of the energy range of a window, relative to its start
+	static constexpr int PULSE_TAIL = WINDOW - 2 - RANGE_FROM + RANGE_TO;
+	static constexpr int ENERGY_LAG = WINDOW + RANGE_FROM;
+	static constexpr int RECORD_TAIL = PULSE_TAIL + WINDOW + ENERGY_LAG - TRIGGER_LAG + 1;
+
+	static_assert(RANGE_FROM >= 0 && RANGE_TO > 0, "empty energy range");
+	// energy_integration keeps two ranges, so a range ends before the one of the pulse after next is set:
+	// triggers are WINDOW + 2 samples apart at least, the zero crossing is up to WINDOW - 2 into the window
+	// and both are set in different beats of up to 8 samples. RANGE_FROM moves every range alike.
+	static_assert(RANGE_TO <= WINDOW - 3, "energy range overlaps the range of the pulse after next");
+	static_assert(SLOPE == 1 || SLOPE == -1, "SLOPE is the pulse polarity");
+	static_assert(DELAY > 0 && DELAY < WINDOW, "DELAY outside the window");
+};
+
+/*
+ * tools/dpsa_config.cpp writes dpsa_config.h with the DPSA_PARAMS of a
+ * config.ini channel; build with -DDPSA_CONFIG to specialise the kernels.
+ */
+#ifdef DPSA_CONFIG
+#include "dpsa_config.h"
+#else
+#define DPSA_PARAMS 350, 50, 300, 10, -1, 1, 0
+#endif
+typedef dpsa_params<DPSA_PARAMS> dpsa_config;
+
+// True where v is past th in the direction of the pulses
+template <class P, class V, class W>
+static bool beyond(V v, W th)
+{
+	return P::SLOPE < 0 ? v < th : v > th;
+}
+
+// Prefix sums of x and x*x over a record and its tail, and prefix count of its clipped samples
+typedef ap_int<48> prefix_t;
+typedef ap_int<64> prefix2_t;
+typedef ap_uint<16> clip_t;
+
+template <int N>
+struct trigger_token
+{
+	int x[N];
+	prefix_t p[N];
+	prefix2_t p2[N];
+	clip_t c[N];
+	bool trigger[N];
+	bool last;
+};
+
+// Samples are numbered by I, the index_t of the input mode
+template <class I>
+struct window_info
+{
+	I start;
+	float baseline;
+	float stdbaseline;
+	short clipped;
+};
+
+// window is set once per window, on the sample that completes its baseline
+template <int N, class I>
+struct baseline_token
+{
+	int x[N];
+	prefix_t p[N];
+	bool window[N];
+	window_info<I> w;
+	bool last;
+};
+
+template <class T, int N, class I>
+struct shaped_token
+{
+	prefix_t p[N];
+	typename T::sample_t s[N];
+	bool window[N];
+	window_info<I> w;
+	bool last;
+};
+
+// Sample WINDOW behind the input; window is set on the first sample of a window
+template <class T, int N, class I>
+struct cfd_token
+{
+	prefix_t p[N];
+	typename T::sample_t rc[N];
+	typename T::sample_t cfd[N];
+	bool window[N];
+	window_info<I> w;
+	bool last;
+};
+
+template <class I>
+struct pulse_info
+{
+	I from;
+	bool found;
+	short pileup;
+	short clipped;
+	float baseline;
+	float stdbaseline;
+	float time;
+};
+
+// Energy windows [from, to] in samples of the energy range, method NO_ENERGY when unused
+struct energy_windows
+{
+	ap_int<3> method[ENERGIES];
+	short from[ENERGIES];
+	short to[ENERGIES];
+};
+
+// Cut of the energy vs tail/total plane, linear between points and flat after the last one
+struct psd_cut
+{
+	ap_int<4> tail;
+	ap_int<4> total;
+	ap_int<3> keep;
+	ap_int<5> points;
+	float energy[MAX_PSD_POINTS];
+	float ratio[MAX_PSD_POINTS];
+	float slope[MAX_PSD_POINTS];
+};
+
+// pulse is set on the last sample of a window
+template <int N, class I>
+struct pulse_token
+{
+	prefix_t p[N];
+	bool pulse[N];
+	pulse_info<I> info;
+	bool last;
+};
+
+// The results of a pulse and the sample of its zero crossing, in pulse order; end closes the record
+template <class I>
+struct pulse_event
+{
+	float res[RESULT_SIZE];
+	I sample;
+	bool end;
+};
+
+/*
+ * The host table holds the config.ini windows, relative to the zero crossing.
+ * They move to the start of the energy range and are clamped to it; windows
+ * left empty are not computed.
+ */
+template <class P>
+static void load_windows(int * windows, energy_windows & w)
+{
+mem_windows_rd:
+	for (int e = 0; e < ENERGIES; e++) {
+#pragma HLS PIPELINE II=1
+		const int method = windows[WINDOW_ARGS*e + WINDOW_METHOD];
+		int from = windows[WINDOW_ARGS*e + WINDOW_FROM] + P::RANGE_FROM;
+		int to = windows[WINDOW_ARGS*e + WINDOW_TO] + P::RANGE_FROM;
+		from = from < 0 ? 0 : from;
+		to = to > P::RANGE_TO ? P::RANGE_TO : to;
+		const bool valid = method >= MAX_AMPLITUDE && method <= PEAK2PEAK && from <= to;
+		w.method[e] = valid ? method : NO_ENERGY;
+		w.from[e] = from;
+		w.to[e] = to;
+	}
+}
+
+/*
+ * The host table holds the cut in kernel units. Without valid tail and total
+ * energies there are no points, nothing is classified and everything is kept.
+ */
+static void load_psd(float * psd, psd_cut & c)
+{
+	float args[PSD_ARGS];
+mem_psd_rd:
+	for (int i = 0; i < PSD_ARGS; i++) {
+#pragma HLS PIPELINE II=1
+		args[i] = psd[i];
+	}
+	const int tail = args[PSD_TAIL];
+	const int total = args[PSD_TOTAL];
+	const int points = args[PSD_POINTS];
+	const bool valid = tail >= 0 && tail < ENERGIES && total >= 0 && total < ENERGIES && points >= 1 && points <= MAX_PSD_POINTS;
+	c.tail = valid ? tail : 0;
+	c.total = valid ? total : 0;
+	c.keep = valid ? (int)args[PSD_KEEP] : PARTICLE_NONE;
+	c.points = valid ? points : 0;
+	for (int k = 0; k < MAX_PSD_POINTS; k++) {
+		c.energy[k] = args[PSD_CUT_ENERGY + k];
+		c.ratio[k] = args[PSD_CUT_RATIO + k];
+	}
+	for (int k = 0; k < MAX_PSD_POINTS; k++) {
+		c.slope[k] = k + 1 < points ? (c.ratio[k + 1] - c.ratio[k])/(c.energy[k + 1] - c.energy[k]) : 0.0f;
+	}
+}
+
+/*
+ * Tail/total ratio of a pulse, 0 without PSD, and its particle: neutrons lie above the cut.
+ * Every segment is tested at once, so the latency does not depend on the pulse.
+ */
+static void psd_classify(const psd_cut & c, float tail, float total, float & ratio, int & particle)
+{
+	ratio = c.points > 0 && total > 0 ? tail/total : 0.0f;
+	int seg = -1;
+	for (int k = 0; k < MAX_PSD_POINTS; k++) {
+#pragma HLS unroll
+		if (k < c.points && total >= c.energy[k])
+			seg = k;
+	}
+	particle = PARTICLE_NONE;
+	if (seg >= 0) {
+		const float cut = c.ratio[seg] + c.slope[seg]*(total - c.energy[seg]);
+		particle = ratio > cut ? PARTICLE_NEUTRON : PARTICLE_GAMMA;
+	}
+}
+
+/*
+ * Input beats. krnl_dpsa and krnl_dpsa_stream take one ap_axis sample per
+ * beat, krnl_dpsa_wide the 128-bit beats of krnl_JESD204B_tx, eight samples
+ * with the first one in the least significant bits, and the wide stream
+ * kernels the same eight samples framed by TLAST.
+ */
+template <class AXIS>
+struct input_beat
+{
+	static const int N = 1;
+
+	static void samples(const AXIS & v, int x[N]) { x[0] = v.data; }
+	static bool last(const AXIS & v) { return v.last; }
+};
+
+template <>
+struct input_beat<uint128_t>
+{
+	static const int N = 8;
+
+	static void samples(const uint128_t & v, int x[N])
+	{
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			x[k] = ap_int<16>(v.range(16*k + 15, 16*k));
+		}
+	}
+	static bool last(const uint128_t &) { return false; }
+};
+
+template <>
+struct input_beat<wide_axis>
+{
+	static const int N = 8;
+
+	static void samples(const wide_axis & v, int x[N]) { input_beat<uint128_t>::samples(v.data, x); }
+	static bool last(const wide_axis & v) { return v.last; }
+};
+
+/*
+ * Input modes. Batch records are size samples back to back; FRAMED streams
+ * end every record with TLAST and samples beyond size are dropped. The
+ * CONTINUOUS stream is a single record that never ends, or ends after size
+ * samples: windows reach back across what would be record boundaries and
+ * take every pulse once, and its samples are numbered with 64 bits so that
+ * the indices never wrap. The prefix sums do wrap there, but windows only
+ * take their differences, which wrap back.
+ */
+template <bool FRAMED_, bool CONTINUOUS_, class I>
+struct input_mode
+{
+	static const bool FRAMED = FRAMED_;
+	static const bool CONTINUOUS = CONTINUOUS_;
+	typedef I index_t;
+};
+
+typedef input_mode<false, false, int> batch_input;
+typedef input_mode<true, false, int> framed_input;
+typedef input_mode<false, true, long long> continuous_input;
+
+/*
+ * The running sums of a beat are added to those of the record once, after
+ * its lanes, so the loop carries a single addition whatever N is. Records
+ * report MAX_PEAKS pulses at most, so later triggers are ignored; the
+ * continuous stream has no such limit.
+ */
+template <class P, class M, class AXIS>
+static void read_trigger(hls::stream<AXIS> & in_stream, hls::stream<trigger_token<input_beat<AXIS>::N> > & out, int baseline, float threshold, typename M::index_t size)
+{
+	typedef typename M::index_t I;
+	static const int N = input_beat<AXIS>::N;
 	bool set_index = false;
-	for (int i = 0; i < size; i++) {
+	bool got_last = false;
+	short npeaks = 0;
+	I start_index = 0;
+	I end = 0;
+	prefix_t p = 0;
+	prefix2_t p2 = 0;
+	clip_t c = 0;
+	bool last = false;
+
 read_waveform:
-		ap_axis<16, 0, 0, 0> v = in_stream.read();
-		l_in[i] = v.data - baseline;
-set_start_index:
-		if (l_in[i] < threshold && !set_index) {
-			start_index[npeaks] = i - SIZE - RANGE_FROM;
-			set_index = true;
-			++npeaks;
+	for (I t = 0; !last; t++) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = DATA_SIZE/N max = 2*DATA_SIZE/N
+		trigger_token<N> o;
+		int data[N];
+#pragma HLS ARRAY_PARTITION variable=data dim=1 complete
+		const bool valid = M::CONTINUOUS ? size == 0 || N*t < size : N*t < size && !got_last;
+		if (valid) {
+			AXIS v = in_stream.read();
+			if (M::FRAMED)
+				got_last = input_beat<AXIS>::last(v);
+			input_beat<AXIS>::samples(v, data);
 		}
-		if(set_index and (npeaks >= 1)){
-			if ((i - start_index[npeaks - 1] - SIZE - RANGE_FROM) > 3*SIZE){
-				set_index = false;
+		prefix_t beat_p = 0;
+		prefix2_t beat_p2 = 0;
+		clip_t beat_c = 0;
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			const I i = N*t + k;
+			o.x[k] = 0;
+			o.trigger[k] = false;
+			bool clip = false;
+			if (valid) {
+				o.x[k] = data[k] - baseline;
+				clip = data[k] >= ADC_RAIL_HIGH || data[k] <= ADC_RAIL_LOW;
+set_start_index:
+				if (beyond<P>(o.x[k], threshold) && !set_index && (M::CONTINUOUS || npeaks < MAX_PEAKS)) {
+					start_index = i - P::TRIGGER_LAG;
+					set_index = true;
+					if (!M::CONTINUOUS)
+						++npeaks;
+					o.trigger[k] = true;
+					end = i + P::RECORD_TAIL;
+				}
+				if (set_index && (i - start_index - P::TRIGGER_LAG) > P::WINDOW)
+					set_index = false;
 			}
+			beat_p += o.x[k];
+			beat_p2 += (prefix2_t)o.x[k]*o.x[k];
+			beat_c += clip;
+			o.p[k] = p + beat_p;
+			o.p2[k] = p2 + beat_p2;
+			o.c[k] = c + beat_c;
 		}
-    }
+		p += beat_p;
+		p2 += beat_p2;
+		c += beat_c;
+		if (M::CONTINUOUS)
+			last = size != 0 && N*(t + 1) >= size && N*(t + 1) >= end;
+		else
+			last = (N*(t + 1) >= size || got_last) && N*(t + 1) >= end;
+		o.last = last;
+		out.write(o);
+	}
+drain_frame:
+	while (M::FRAMED && !got_last) {
+		got_last = input_beat<AXIS>::last(in_stream.read());
+	}
 }
 
-static void baseline_calc(float & baseline, float & stdbaseline, float * Signal_out, int * Signal, int bs_start, int bs_end, int pulse_start, int pulse_end)
+/*
+ * The sums and sums of squares over the first and the last SIZE samples of
+ * the window are exact integers, so the float and fixed datapaths share them.
+ */
+template <class P>
+static void baseline_calc(float & baseline, float & stdbaseline, ap_int<32> s_left, ap_int<64> s2_left, ap_int<32> s_right, ap_int<64> s2_right)
 {
-	float s_left = 0;
-	float s_right = 0;
-	float s2_left = 0;
-	float s2_right = 0;
+	const int total = P::SIZE;
 
-	int lpoints = pulse_start - bs_start;
-	int rpoints = bs_end - pulse_end;
-	int total_left = 0;
-	int total_right = 0;
+	float l_baseline = float(s_left + s_right)/(2*total);
+	float l_stdbaseline = sqrt(float(s2_left + s2_right)/(2*total) - l_baseline*l_baseline);
 
-#pragma BASELINE CALC
-	while (lpoints > 0)	{
-		float p = Signal[pulse_start - lpoints];
-		s_left += p;
-		s2_left += p*p;
-		lpoints--;
-		total_left++;
+	s2_left *= total;
+	s2_left -= s_left*s_left;
+
+	s2_right *= total;
+	s2_right -= s_right*s_right;
+
+	float var_left = sqrt(float(s2_left))/total;
+	float var_right = sqrt(float(s2_right))/total;
+	float baseline_left = float(s_left) / total;
+	float baseline_right = float(s_right) / total;
+
+	if (var_left < var_right) {
+		if (fabs(baseline_right - baseline_left) < 3 * var_left) {
+			baseline = l_baseline;
+			stdbaseline = l_stdbaseline;
+		}
+		else {
+			baseline = baseline_left;
+			stdbaseline = var_left;
+		}
 	}
-	while (rpoints > 0) {
-		float p = Signal[pulse_end + rpoints];
-		s_right += p;
-		s2_right += p*p;
-		rpoints--;
-		total_right++;
+	else {
+		if (fabs(baseline_right - baseline_left) < 3 * var_right) {
+			baseline = l_baseline;
+			stdbaseline = l_stdbaseline;
+		}
+		else {
+			baseline = baseline_right;
+			stdbaseline = var_right;
+		}
 	}
+}
 
-	float l_baseline = (s_left + s_right)/(total_left + total_right);
-	float l_stdbaseline = sqrt((s2_left + s2_right)/(total_left + total_right) - l_baseline*l_baseline);
+/*
+ * The left sums of a window, [start, start + SIZE), come from the prefix
+ * history after its trigger; the right ones, (start + 2*SIZE, start + WINDOW],
+ * from the prefix sums that go by. The clipped samples of the whole window
+ * are counted the same way, and with REJECT a clipped window is not passed on.
+ * The history keeps whole beats; windows are more than a beat apart, so a
+ * beat completes at most one.
+ */
+template <class P, class M, int N>
+static void window_baseline(hls::stream<trigger_token<N> > & in, hls::stream<baseline_token<N, typename M::index_t> > & out)
+{
+	typedef typename M::index_t I;
+	static const int BEATS = line_beats(P::TRIGGER_LAG + 1, N);
+	prefix_t p_line[BEATS][N];
+	prefix2_t p2_line[BEATS][N];
+	clip_t c_line[BEATS][N];
+#pragma HLS ARRAY_PARTITION variable=p_line dim=2 complete
+#pragma HLS ARRAY_PARTITION variable=p2_line dim=2 complete
+#pragma HLS ARRAY_PARTITION variable=c_line dim=2 complete
+	prefix_t p_from = 0, p_to = 0;
+	prefix2_t p2_from = 0, p2_to = 0;
+	clip_t c_from = 0;
+	ap_int<32> s_left = 0;
+	ap_int<64> s2_left = 0;
+	bool pending = false;
+	bool left_end = false;
+	I start = 0;
+	bool last = false;
 
-	s2_left *= total_left;
-	s2_left -= s_left*s_left;
+baseline_sums:
+	for (I t = 0; !last; t++) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = DATA_SIZE/N max = 2*DATA_SIZE/N
+		trigger_token<N> v = in.read();
+		last = v.last;
 
-	s2_right *= total_right;
-	s2_right -= s_right*s_right;
+		bool trigger = false;
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			if (v.trigger[k]) {
+				start = N*t + k - P::TRIGGER_LAG;
+				trigger = true;
+			}
+		}
+		if (trigger)
+			pending = true;
+		// One history read per beat: the two ends of the left window on the trigger beat and the next one
+		I l = -1;
+		if (trigger)
+			l = start - 1;
+		if (left_end)
+			l = start + P::SIZE - 1;
+		const int l_beat = (l/N) & (BEATS - 1);
+		const prefix_t p_l = l >= 0 ? p_line[l_beat][l % N] : prefix_t(0);
+		const prefix2_t p2_l = l >= 0 ? p2_line[l_beat][l % N] : prefix2_t(0);
+		const clip_t c_l = l >= 0 ? c_line[l_beat][l % N] : clip_t(0);
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			p_line[t & (BEATS - 1)][k] = v.p[k];
+			p2_line[t & (BEATS - 1)][k] = v.p2[k];
+			c_line[t & (BEATS - 1)][k] = v.c[k];
+		}
 
-	if (total_right != 0 && total_left != 0) {
-		float var_left = sqrt(s2_left)/total_left;
-		float var_right = sqrt(s2_right)/total_right;
-		float baseline_left = s_left / total_left;
-		float baseline_right = s_right / total_right;
+		if (trigger) {
+			p_from = p_l;
+			p2_from = p2_l;
+			c_from = c_l;
+		}
+		if (left_end) {
+			s_left = p_l - p_from;
+			s2_left = p2_l - p2_from;
+		}
+		left_end = trigger;
 
-		if (var_left < var_right) {
-			if (fabs(baseline_right - baseline_left) < 3 * var_left) {
-				baseline = l_baseline;
-				stdbaseline = l_stdbaseline;
+		baseline_token<N, I> o;
+		o.last = last;
+		o.w.start = start;
+		o.w.baseline = 0;
+		o.w.stdbaseline = 0;
+		o.w.clipped = 0;
+		bool complete = false;
+		prefix_t p_end = 0;
+		prefix2_t p2_end = 0;
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			const I i = N*t + k;
+			o.x[k] = v.x[k];
+			o.p[k] = v.p[k];
+			o.window[k] = false;
+			if (pending && i == start + 2*P::SIZE) {
+				p_to = v.p[k];
+				p2_to = v.p2[k];
 			}
-			else {
-				baseline = baseline_left;
-				stdbaseline = var_left;
+			if (pending && i == start + P::WINDOW) {
+				complete = true;
+				p_end = v.p[k];
+				p2_end = v.p2[k];
+				o.w.clipped = clip_t(v.c[k] - c_from);
+				o.window[k] = !(P::REJECT && o.w.clipped > 0);
 			}
 		}
-		else {
-			if (fabs(baseline_right - baseline_left) < 3 * var_right) {
-				baseline = l_baseline;
-				stdbaseline = l_stdbaseline;
+		if (complete) {
+			baseline_calc<P>(o.w.baseline, o.w.stdbaseline, s_left, s2_left, ap_int<32>(p_end - p_to), ap_int<64>(p2_end - p2_to));
+			pending = false;
+		}
+		out.write(o);
+	}
+}
+
+/*
+ * The signal is shaped once, before the baseline of the windows is known.
+ * Both filters have unit gain, so the shaped baseline is the window baseline
+ * and compute_cfd subtracts it afterwards.
+ *
+ * RC_SHAPING: 20-tap FIR of the truncated RC response, normalised by h_sum.
+ * RC_IIR_SHAPING: exact one-pole RC, y[n] = a*x[n] + b*y[n-1], with a = h[0] and b = h[1].
+ * RC4_SHAPING: four of those poles in cascade.
+ *
+ * The FIR is polyphase, every lane with its own taps over the shift register.
+ * The pole looks ahead over the beat: lane k is y[k] = sum a*b^(k-j)*x[j] +
+ * b^(k+1)*y[-1], so only the last lane of a beat feeds the next beat.
+ */
+template <class T, class M, int N>
+static void shape_signal(hls::stream<baseline_token<N, typename M::index_t> > & in, hls::stream<shaped_token<T, N, typename M::index_t> > & out, hls::vector<typename T::coef_t,20> & h, float h_sum, int shaping)
+{
+	typedef typename M::index_t I;
+	typedef typename T::acc_t acc_t;
+	typedef typename T::coef_t coef_t;
+	typedef typename T::mac_t mac_t;
+	typename T::sample_t x_shift[FIR_N + N - 1];
+#pragma HLS ARRAY_PARTITION variable=x_shift dim=1 complete
+	acc_t y[IIR_STAGES] = {0, 0, 0, 0};
+#pragma HLS ARRAY_PARTITION variable=y dim=1 complete
+	// a*b^k and b^(k+1)
+	coef_t ab[N];
+	coef_t bb[N];
+#pragma HLS ARRAY_PARTITION variable=ab dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=bb dim=1 complete
+	const int stages = shaping == RC4_SHAPING ? IIR_STAGES : 1;
+	bool last = false;
+
+	for (int i = 0; i < FIR_N + N - 1; i++) {
+#pragma HLS unroll
+		x_shift[i] = 0;
+	}
+	ab[0] = h[0];
+	bb[0] = h[1];
+	for (int k = 1; k < N; k++) {
+		ab[k] = ab[k - 1]*h[1];
+		bb[k] = bb[k - 1]*h[1];
+	}
+
+execute_shaping:
+	for (I t = 0; !last; t++) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = DATA_SIZE/N max = 2*DATA_SIZE/N
+		baseline_token<N, I> v = in.read();
+		last = v.last;
+
+		// Newest sample first: lane k is at N - 1 - k
+		for (int i = FIR_N + N - 2; i >= N; i--) {
+#pragma HLS unroll
+			x_shift[i] = x_shift[i - N];
+		}
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			x_shift[N - 1 - k] = v.x[k];
+		}
+
+		acc_t s[N];
+#pragma HLS ARRAY_PARTITION variable=s dim=1 complete
+		if (shaping == RC_SHAPING) {
+			for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+				acc_t lsignal_sum = 0;
+				acc_t lhxin[20];
+#pragma HLS ARRAY_PARTITION variable=lhxin dim=1 complete
+				for (int i = 0; i < FIR_N; i++) {
+#pragma HLS unroll
+					lhxin[i] = x_shift[N - 1 - k + i]*h[i];
+				}
+				for (int i = 0; i < FIR_N; i++) {
+#pragma HLS unroll
+					lsignal_sum += lhxin[i];
+				}
+				s[k] = T::normalise(lsignal_sum, h_sum);
+			}
+		} else {
+			for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+				s[k] = x_shift[N - 1 - k];
 			}
-			else {
-				baseline = baseline_right;
-				stdbaseline = var_right;
+			for (int i = 0; i < IIR_STAGES; i++) {
+#pragma HLS unroll
+				if (i < stages) {
+					acc_t x[N];
+#pragma HLS ARRAY_PARTITION variable=x dim=1 complete
+					for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+						mac_t m = 0;
+						for (int j = 0; j <= k; j++) {
+#pragma HLS unroll
+							m += ab[k - j]*s[j];
+						}
+						// The previous beat last, so the recurrence is a single multiply-add
+						m += bb[k]*y[i];
+						x[k] = m;
+					}
+					y[i] = x[N - 1];
+					for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+						s[k] = x[k];
+					}
+				}
 			}
 		}
+
+		shaped_token<T, N, I> o;
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			o.p[k] = v.p[k];
+			o.s[k] = s[k];
+			o.window[k] = v.window[k];
+		}
+		o.w = v.w;
+		o.last = last;
+		out.write(o);
 	}
-	else if (total_left) {
-		stdbaseline = sqrt(s2_left)/total_left;
-		baseline = s_left / total_left;
+}
+
+/*
+ * out holds the samples D behind the lanes of beat t and the line keeps the
+ * past beats. When D is not a multiple of N they come from two beats of the
+ * line, the one read on this beat and the one held from the previous one.
+ * Samples before the first beat are 0.
+ */
+template <int D, int BEATS, int N, class V, class I>
+static void delay_lanes(V line[][N], V held[N], I t, const V in[N], V out[N])
+{
+	static const int Q = D/N;
+	static const int R = D%N;
+	static_assert(Q >= 1 && BEATS > Q, "the line must hold D samples past the beat");
+	V cur[N];
+#pragma HLS ARRAY_PARTITION variable=cur dim=1 complete
+	for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+		cur[k] = t >= Q ? line[(t - Q) & (BEATS - 1)][k] : V(0);
 	}
-	else if (total_right) {
-		stdbaseline = sqrt(s2_right)/total_right;
-		baseline = s_right / total_right;
+	for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+		out[k] = k >= R ? cur[k - R] : held[k - R + N];
 	}
-	else {
-		stdbaseline = 0;
-		baseline = 0;
+	for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+		held[k] = cur[k];
+		line[t & (BEATS - 1)][k] = in[k];
 	}
-#pragma LOAD Baseline signal
-	for (int i = 0; i < 3*SIZE; i ++)
-		Signal_out[i] = Signal[bs_start + i] - baseline;
-
 }
 
-static void compute_rc_cfd(float * l_in, hls::vector<float,20> & h, float h_sum, float * rc_vector, float * cfd_vector, float factor, float scale)
+/*
+ * rc[n] = (s[n] - baseline)*scale and cfd[n] = rc[n] - factor*rc[n+DELAY],
+ * WINDOW samples behind the input. The leading samples come out of the
+ * delay line and a shift register DELAY samples deep behind them keeps the
+ * current ones.
+ */
+template <class T, class P, class M, int N>
+static void compute_cfd(hls::stream<shaped_token<T, N, typename M::index_t> > & in, hls::stream<cfd_token<T, N, typename M::index_t> > & out, typename T::coef_t factor, typename T::coef_t scale)
 {
-execute_fir_cfd:
-	for (int n = 0; n < 3*SIZE; ++n) {
-#pragma HLS LOOP_TRIPCOUNT min = c_size max = c_size
+	typedef typename M::index_t I;
+	typedef typename T::sample_t sample_t;
+	static const int BEATS = line_beats(P::ENERGY_LAG, N);
+	prefix_t p_line[BEATS][N];
+	sample_t s_line[BEATS][N];
+#pragma HLS ARRAY_PARTITION variable=p_line dim=2 complete
+#pragma HLS ARRAY_PARTITION variable=s_line dim=2 complete
+	prefix_t p_held[N];
+	sample_t s_held[N];
+#pragma HLS ARRAY_PARTITION variable=p_held dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=s_held dim=1 complete
+	// Leading samples, newest first
+	prefix_t p_shift[P::DELAY + N];
+	sample_t s_shift[P::DELAY + N];
+#pragma HLS ARRAY_PARTITION variable=p_shift dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=s_shift dim=1 complete
+	sample_t baseline = 0;
+	bool last = false;
 
-		float lsignal_sum = 0;
-		float lhxin[20];
-		for (int i = 0; i < FIR_N; i++) {
-#pragma HLS unroll factor=20
-#pragma HLS ARRAY_PARTITION variable=l_in dim=1 complete
-			lhxin[i] = l_in[n-i]*h[i];
+	for (int i = 0; i < N; i++) {
+#pragma HLS unroll
+		p_held[i] = 0;
+		s_held[i] = 0;
+	}
+	for (int i = 0; i < P::DELAY + N; i++) {
+#pragma HLS unroll
+		p_shift[i] = 0;
+		s_shift[i] = 0;
+	}
+
+execute_cfd:
+	for (I t = 0; !last; t++) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = DATA_SIZE/N max = 2*DATA_SIZE/N
+		shaped_token<T, N, I> v = in.read();
+		last = v.last;
+
+		prefix_t p_lead[N];
+		sample_t s_lead[N];
+#pragma HLS ARRAY_PARTITION variable=p_lead dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=s_lead dim=1 complete
+		delay_lanes<P::WINDOW - P::DELAY, BEATS>(p_line, p_held, t, v.p, p_lead);
+		delay_lanes<P::WINDOW - P::DELAY, BEATS>(s_line, s_held, t, v.s, s_lead);
+
+		for (int i = P::DELAY + N - 1; i >= N; i--) {
+#pragma HLS unroll
+			p_shift[i] = p_shift[i - N];
+			s_shift[i] = s_shift[i - N];
 		}
-		for (int i = 0; i < FIR_N; i++){
-#pragma HLS unroll factor=20
-#pragma HLS ARRAY_PARTITION variable=lhxin dim=1 complete
-			lsignal_sum += lhxin[i];
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			p_shift[N - 1 - k] = p_lead[k];
+			s_shift[N - 1 - k] = s_lead[k];
 		}
-		float l_result = lsignal_sum/h_sum;
-		rc_vector[n] = l_result*scale;
+
+		cfd_token<T, N, I> o;
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			if (v.window[k])
+				baseline = v.w.baseline;
+			const prefix_t p_cur = p_shift[N - 1 - k + P::DELAY];
+			const sample_t s_cur = s_shift[N - 1 - k + P::DELAY];
+			o.p[k] = p_cur;
+			o.rc[k] = (s_cur - baseline)*scale;
+			sample_t rc_lead = (s_lead[k] - baseline)*scale;
+			o.cfd[k] = o.rc[k] - factor*rc_lead;
+			o.window[k] = v.window[k];
+		}
+		o.w = v.w;
+		o.last = last;
+		out.write(o);
 	}
-execute_cfd:
-	for (int i=DELAY; i < 3*SIZE; i++ )	{
-		cfd_vector[i-DELAY] = rc_vector[i-DELAY] - factor*rc_vector[i];
+}
+
+#define SPLINE_STEPS 3
+
+/*
+ * Zero of the cubic through the CFD samples y0..y3 at -1, 0, 1 and 2, between
+ * y1 and y2, as an offset from y1. The 2 point interpolation is refined by
+ * SPLINE_STEPS Newton steps kept in [0, 1], a fixed latency for any pulse.
+ */
+static float cfd_spline(float y0, float y1, float y2, float y3)
+{
+	const float c0 = y1;
+	const float c1 = -y0/3 - y1/2 + y2 - y3/6;
+	const float c2 = y0/2 - y1 + y2/2;
+	const float c3 = (y3 - y0)/6 + (y1 - y2)/2;
+	float x = -y1/(y2-y1);
+	for (int i = 0; i < SPLINE_STEPS; i++) {
+#pragma HLS unroll
+		const float f = c0 + x*(c1 + x*(c2 + x*c3));
+		const float df = c1 + x*(2*c2 + 3*x*c3);
+		x = df != 0 ? x - f/df : x;
+		x = x < 0 ? 0.0f : x > 1 ? 1.0f : x;
 	}
+	return x;
 }
 
-static void peak_detection(short &pileup, float &time, float * rc_peak_signal, float * no_shape_signal, float * rc_vector, float * cfd_vector, int start_index, float threshold)
+// How the zero crossing of a pulse is found, see zero_cross
+#define CROSS_NONE 0
+#define CROSS_FORWARD 1
+#define CROSS_FIRST 2
+#define CROSS_TAIL 3
+#define CROSS_FOUND 4
+
+/*
+ * Pulses are the samples where rc goes below threshold, with the left and
+ * right pileup rules of the window. The zero crossing of a pulse is at the
+ * last non negative CFD sample before it (or the first sample of the window
+ * if there is none) when the CFD is negative at the pulse, and before the
+ * next negative CFD sample otherwise. Both are tracked as the window goes
+ * by, every pulse slot compared in parallel on each sample: the last non
+ * negative sample is kept in registers and the pulses waiting for a negative
+ * sample are CROSS_FORWARD. The spline also needs the samples around the
+ * crossing, so a slot stays CROSS_TAIL until the one after it arrives; at
+ * the window edges the time falls back to the 2 point interpolation. The
+ * pulse event, with the time of the last pulse, leaves on the last sample
+ * of the window; the time is computed once, after the lanes of the beat.
+ * The time is a position in the record; on the CONTINUOUS stream, whose
+ * indices a float cannot hold, it is the offset from the sample before the
+ * zero crossing, or 0 from the trigger sample when no pulse is found.
+ */
+template <class T, class P, class M, int N>
+static void zero_cross(hls::stream<cfd_token<T, N, typename M::index_t> > & in, hls::stream<pulse_token<N, typename M::index_t> > & out, typename T::sample_t threshold)
 {
-	short bthresholds[3*SIZE];
-	short cfdsigns[3*SIZE];
-	bool peak_detected = false;
-	unsigned int index[MAX_PEAKS];
+	typedef typename M::index_t I;
+	// The right pileup test reads one entry past the last pulse
+	unsigned int index[MAX_PEAKS + 1];
+	ap_uint<3> cross[MAX_PEAKS];
+	unsigned int cross_j[MAX_PEAKS];
+	float cross_y0[MAX_PEAKS];
+	float cross_y1[MAX_PEAKS];
+	float cross_y2[MAX_PEAKS];
+	float cross_y3[MAX_PEAKS];
+#pragma HLS ARRAY_PARTITION variable=index dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=cross dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=cross_j dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=cross_y0 dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=cross_y1 dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=cross_y2 dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=cross_y3 dim=1 complete
+	bool active = false;
+	int r = 0;
+	window_info<I> w;
 	short numberpulses = 0;
+	short pileup = 0;
+	bool peak_detected = false;
+	// Last non negative CFD sample, the one before it and the two after it
+	bool pos_valid = false;
+	int pos_j = 0;
+	float pos_y0 = 0;
+	float pos_y1 = 0;
+	float pos_y2 = 0;
+	float pos_y3 = 0;
+	float first_y1 = 0;
+	float first_y2 = 0;
+	float prev = 0;
+	float prev2 = 0;
+	bool last = false;
 
 peak_detection:
-	for(int i = 0; i < 3*SIZE; i++) {
+	for (I t = 0; !last; t++) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = DATA_SIZE/N max = 2*DATA_SIZE/N
+		cfd_token<T, N, I> v = in.read();
+		last = v.last;
 
-		bool belowth = false;
-		float tmprc=rc_vector[i];
-		float tmpcfd=cfd_vector[i];
+		pulse_token<N, I> o;
+		o.last = last;
+		// Pulses are more than a beat apart, but the next window can start in
+		// the beat that ends one: the crossing of its last pulse is kept here
+		bool window_end = false;
+		bool spline = false;
+		unsigned int j = 0;
+		float y0 = 0, y1 = 0, y2 = 0, y3 = 0;
 
-		if (tmprc < threshold) {
-			bthresholds[i]=-1;
-			belowth = true;
-		} else {
-			bthresholds[i] = 1;
-			belowth = false;
-			peak_detected = false;
-		}
-		if (tmpcfd < 0) {
-			cfdsigns[i] = -1;
-		} else {
-			cfdsigns[i] = 1;
-		}
+		for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+			o.p[k] = v.p[k];
+			o.pulse[k] = false;
+
+			if (v.window[k]) {
+				active = true;
+				r = 0;
+				w = v.w;
+				numberpulses = 0;
+				pileup = 0;
+				peak_detected = false;
+				pos_valid = false;
+				for (int i = 0; i <= MAX_PEAKS; i++) {
+#pragma HLS unroll
+					index[i] = 0;
+				}
+				for (int i = 0; i < MAX_PEAKS; i++) {
+#pragma HLS unroll
+					cross[i] = CROSS_NONE;
+				}
+			}
 
-		if (belowth && !peak_detected) 	{
+			if (active) {
+				const float cur = v.cfd[k];
+				const bool negative = beyond<P>(v.cfd[k], 0);
 
-			peak_detected = true;
+				if (!negative) {
+					pos_valid = true;
+					pos_j = r;
+					pos_y0 = prev;
+					pos_y1 = cur;
+				} else if (r > 0 && !beyond<P>(prev, 0)) {
+					pos_y2 = cur;
+				} else if (r > 1 && !beyond<P>(prev2, 0)) {
+					pos_y3 = cur;
+				}
+				if (r == 0)
+					first_y1 = cur;
+				if (r == 1)
+					first_y2 = cur;
 
-			index[numberpulses]=i;
-			++numberpulses;
+				for (int i = 0; i < MAX_PEAKS; i++) {
+#pragma HLS unroll
+					if (cross[i] == CROSS_TAIL) {
+						cross[i] = CROSS_FOUND;
+						cross_y3[i] = cur;
+					} else if (cross[i] == CROSS_FORWARD && negative) {
+						cross[i] = CROSS_TAIL;
+						cross_j[i] = r - 1;
+						cross_y0[i] = prev2;
+						cross_y1[i] = prev;
+						cross_y2[i] = cur;
+					}
+				}
 
-			if (numberpulses >= 2) {
-				if((index[numberpulses - 1]-index[numberpulses - 2]) <= SIZE) {
-					//PILEUP LEFT
-					--numberpulses;
-					pileup |= 2;
+				bool belowth = false;
+				if (beyond<P>(v.rc[k], threshold)) {
+					belowth = true;
+				} else {
+					peak_detected = false;
 				}
-				if(numberpulses >= 2 and (index[numberpulses]-index[numberpulses-1]) <= SIZE){
-					//PILEUP RIGHT
-					--numberpulses;
-					pileup |= 1;
+
+				if (belowth && !peak_detected && numberpulses < MAX_PEAKS) {
+
+					peak_detected = true;
+
+					const short slot = numberpulses;
+					index[numberpulses] = r;
+					++numberpulses;
+
+					if (numberpulses >= 2) {
+						if ((index[numberpulses - 1] - index[numberpulses - 2]) <= P::SIZE) {
+							//PILEUP LEFT
+							--numberpulses;
+							pileup |= 2;
+						}
+						if (numberpulses >= 2 and (index[numberpulses] - index[numberpulses - 1]) <= P::SIZE) {
+							//PILEUP RIGHT
+							--numberpulses;
+							pileup |= 1;
+						}
+					} else {
+						pileup = 0;
+					}
+
+					if (!negative) {
+						cross[slot] = CROSS_FORWARD;
+					} else if (pos_valid) {
+						// The sample after the crossing is the next one when the pulse is on the crossing
+						cross[slot] = r == pos_j + 1 ? CROSS_TAIL : CROSS_FOUND;
+						cross_j[slot] = pos_j;
+						cross_y0[slot] = pos_y0;
+						cross_y1[slot] = pos_y1;
+						cross_y2[slot] = pos_y2;
+						cross_y3[slot] = pos_y3;
+					} else {
+						cross[slot] = CROSS_FIRST;
+					}
+				}
+
+				if (r == P::WINDOW - 1) {
+					// The forward search stops at the end of the window
+					for (int i = 0; i < MAX_PEAKS; i++) {
+#pragma HLS unroll
+						if (cross[i] == CROSS_FORWARD) {
+							cross[i] = CROSS_TAIL;
+							cross_j[i] = P::WINDOW - 2;
+							cross_y1[i] = prev;
+							cross_y2[i] = cur;
+						}
+					}
+					o.pulse[k] = true;
+					window_end = true;
+					o.info.pileup = pileup;
+					o.info.clipped = w.clipped;
+					o.info.baseline = w.baseline;
+					o.info.stdbaseline = w.stdbaseline;
+					o.info.found = numberpulses >= 1;
+					o.info.time = M::CONTINUOUS ? 0 : w.start + P::SIZE + P::RANGE_FROM;
+					o.info.from = w.start;
+					const short pulse = numberpulses >= 1 ? numberpulses - 1 : 0;
+					j = 0;
+					y1 = first_y1;
+					y2 = first_y2;
+					if (cross[pulse] == CROSS_TAIL || cross[pulse] == CROSS_FOUND) {
+						j = cross_j[pulse];
+						y1 = cross_y1[pulse];
+						y2 = cross_y2[pulse];
+					}
+					y0 = cross_y0[pulse];
+					y3 = cross_y3[pulse];
+					spline = P::SPLINE && cross[pulse] == CROSS_FOUND && j >= 1;
+					active = false;
 				}
+				prev2 = prev;
+				prev = cur;
+				++r;
+			}
+		}
+
+		if (window_end && o.info.found) {
+			float fine;
+			if (spline) {
+				fine = cfd_spline(y0, y1, y2, y3);
 			} else {
-				pileup = 0;
+				// X = -b(x2-x1)/(y2-y1) = -Y/(y2-y1) = -y1/(y2-y1)
+				fine = -(y1/(y2-y1));
 			}
+			const float zero_cross = j + fine;
+			o.info.time = M::CONTINUOUS ? fine : zero_cross + o.info.from;
+			o.info.from += int(j) - P::RANGE_FROM;
 		}
+		out.write(o);
 	}
+}
+
+/*
+ * Energies of the RANGE_TO + 1 samples from RANGE_FROM before the zero crossing,
+ * ENERGY_LAG samples behind zero_cross. Every window of the table keeps the
+ * sum, sum of squares and extremes of its samples, all updated in the same
+ * pass; the energy of its method is taken from them, less the baseline, at
+ * the end of the range, and so are the PSD ratio and particle. Consecutive
+ * ranges can overlap here, so even and odd ranges take one set of sums each.
+ * The sums take the lanes of a beat in order and the energies of the ranges
+ * that end in it are computed once, after them.
+ *
+ * A pulse without a zero crossing is complete when it arrives, possibly
+ * before the range of the previous one ends, so pulses wait in a ring of
+ * PULSE_ROWS rows and leave in order, one per beat, as events; when the PSD
+ * keeps one particle only the pulses classified as it leave. The sample of
+ * an event is that of its zero crossing, or its trigger without one.
+ */
+#define PULSE_ROWS 4
+
+template <class T, class P, class M, int N>
+static void energy_integration(hls::stream<pulse_token<N, typename M::index_t> > & in, hls::stream<pulse_event<typename M::index_t> > & events, energy_windows & ewin, psd_cut & psd)
+{
+	typedef typename T::acc_t acc_t;
+	typedef typename M::index_t I;
+	static const int BEATS = line_beats(P::ENERGY_LAG, N);
+	float res[PULSE_ROWS][RESULT_SIZE];
+	I at[PULSE_ROWS];
+	bool complete[PULSE_ROWS] = {false, false, false, false};
+	bool kept[PULSE_ROWS];
+#pragma HLS ARRAY_PARTITION variable=res dim=0 complete
+#pragma HLS ARRAY_PARTITION variable=at dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=complete dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=kept dim=1 complete
+	// Rows of the next pulse and of the oldest one not sent
+	ap_uint<2> head = 0;
+	ap_uint<2> tail = 0;
+	prefix_t p_line[BEATS][N];
+	prefix_t p_held[N];
+#pragma HLS ARRAY_PARTITION variable=p_line dim=2 complete
+#pragma HLS ARRAY_PARTITION variable=p_held dim=1 complete
+	prefix_t p_prev = 0;
+	bool range_active[2] = {false, false};
+	I range_from[2];
+	ap_uint<2> range_row[2];
+	float range_baseline[2];
+	ap_int<32> s1[2][ENERGIES];
+	ap_int<48> s2[2][ENERGIES];
+	int hi[2][ENERGIES];
+	int lo[2][ENERGIES];
+#pragma HLS ARRAY_PARTITION variable=range_active dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=range_from dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=range_row dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=range_baseline dim=1 complete
+#pragma HLS ARRAY_PARTITION variable=s1 dim=0 complete
+#pragma HLS ARRAY_PARTITION variable=s2 dim=0 complete
+#pragma HLS ARRAY_PARTITION variable=hi dim=0 complete
+#pragma HLS ARRAY_PARTITION variable=lo dim=0 complete
+	bool last = false;
 
-zero_cross_detection:
-	float zero_cross[MAX_PEAKS];
-	if (numberpulses >= 1) {
+	for (int k = 0; k < N; k++) {
+#pragma HLS unroll
+		p_held[k] = 0;
+	}
 
-		for (int pulse = 0; pulse < numberpulses; pulse++ ) {
+execute_energies:
+	for (I t = 0; !last; t++) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = DATA_SIZE/N max = 2*DATA_SIZE/N
+		pulse_token<N, I> v = in.read();
+		last = v.last;
 
-			if((cfdsigns[index[pulse]] == -1)){
-				do {
-					--index[pulse];
-				} while(cfdsigns[index[pulse]] == -1);
-			} else {
-				while (cfdsigns[index[pulse]] == 1)
-					++index[pulse];
-				--index[pulse];
+		// Samples ENERGY_LAG behind the zero crossing stage
+		prefix_t p[N];
+#pragma HLS ARRAY_PARTITION variable=p dim=1 complete
+		delay_lanes<P::ENERGY_LAG, BEATS>(p_line, p_held, t, v.p, p);
+
+		// A range starts after the pulse that opens it, possibly later in the same beat
+		bool pulse = false;
+		bool done[2] = {false, false};
+#pragma HLS ARRAY_PARTITION variable=done dim=1 complete
+		for (int l = 0; l < N; l++) {
+#pragma HLS unroll
+			const int x = p[l] - p_prev;
+			p_prev = p[l];
+			const ap_int<48> x2 = ap_int<48>(x)*x;
+			const I n = N*t + l - P::ENERGY_LAG - P::WINDOW;
+
+			if (v.pulse[l]) {
+				const int k = head & 1;
+				pulse = true;
+				if (v.info.found) {
+					range_active[k] = true;
+					range_from[k] = v.info.from;
+					range_row[k] = head;
+					range_baseline[k] = v.info.baseline;
+				}
 			}
-			// X = -b(x2-x1)/(y2-y1) = -Y/(y2-y1) = -y1/(y2-y1)
-			zero_cross[pulse] = index[pulse] - (cfd_vector[index[pulse]])/(cfd_vector[index[pulse]+1]-cfd_vector[index[pulse]]);
 
-			time = zero_cross[pulse] + start_index;
+			for (int k = 0; k < 2; k++) {
+#pragma HLS unroll
+				const I i = n - range_from[k];
+				if (range_active[k] && i >= 0) {
+					for (int e = 0; e < ENERGIES; e++) {
+#pragma HLS unroll
+						if (i == ewin.from[e]) {
+							s1[k][e] = x;
+							s2[k][e] = x2;
+							hi[k][e] = x;
+							lo[k][e] = x;
+						} else if (i > ewin.from[e] && i <= ewin.to[e]) {
+							s1[k][e] += x;
+							s2[k][e] += x2;
+							hi[k][e] = x > hi[k][e] ? x : hi[k][e];
+							lo[k][e] = x < lo[k][e] ? x : lo[k][e];
+						}
+					}
+					if (i == P::RANGE_TO)
+						done[k] = true;
+				}
+			}
+		}
 
-			for(int i = index[pulse] - RANGE_FROM; i <= index[pulse] + RANGE_TO; ++i) {
-				rc_peak_signal[i - (index[pulse] - RANGE_FROM)] = no_shape_signal[i];
+		if (pulse) {
+			const ap_uint<2> row = head;
+			res[row][PILEUP] = v.info.pileup;
+			res[row][SATURED] = v.info.clipped;
+			res[row][NPEAKS] = 0;
+			res[row][BASELINE] = v.info.baseline;
+			res[row][STDBASELINE] = v.info.stdbaseline;
+			res[row][PTIME] = v.info.time;
+			at[row] = v.info.found ? v.info.from + P::RANGE_FROM : v.info.from + P::TRIGGER_LAG;
+			kept[row] = psd.keep == PARTICLE_NONE;
+			complete[row] = !v.info.found;
+			if (!v.info.found) {
+				for (int e = 0; e < ENERGIES; e++)
+					res[row][ENERGY + e] = 0;
+				res[row][PSD] = 0;
+				res[row][PARTICLE] = PARTICLE_NONE;
 			}
+			++head;
 		}
+
+		for (int k = 0; k < 2; k++) {
+#pragma HLS unroll
+			if (done[k]) {
+				const float bl = range_baseline[k];
+				const ap_uint<2> row = range_row[k];
+				float energies[ENERGIES];
+#pragma HLS ARRAY_PARTITION variable=energies dim=1 complete
+				for (int e = 0; e < ENERGIES; e++) {
+#pragma HLS unroll
+					const int count = ewin.to[e] - ewin.from[e] + 1;
+					float energy = 0;
+					if (ewin.method[e] == MAX_AMPLITUDE) {
+						// MAX VALUE, the largest excursion in the direction of the pulses
+						const typename T::sample_t ampli = (P::SLOPE < 0 ? lo[k][e] : hi[k][e]) - bl;
+						energy = P::SLOPE*(beyond<P>(ampli, 0) ? acc_t(ampli) : acc_t(0));
+					} else if (ewin.method[e] == AREA) {
+						energy = P::SLOPE*(acc_t(s1[k][e]) - acc_t(count*bl));
+					} else if (ewin.method[e] == RMS) {
+						const float mean = float(s1[k][e])/count;
+						const float square = float(s2[k][e])/count - 2*bl*mean + bl*bl;
+						energy = square > 0 ? float(sqrt(square)) : 0.0f;
+					} else if (ewin.method[e] == PEAK2PEAK) {
+						energy = hi[k][e] - lo[k][e];
+					}
+					res[row][ENERGY + e] = energy;
+					energies[e] = energy;
+				}
+				float ratio;
+				int particle;
+				psd_classify(psd, energies[psd.tail], energies[psd.total], ratio, particle);
+				res[row][PSD] = ratio;
+				res[row][PARTICLE] = particle;
+				kept[row] = psd.keep == PARTICLE_NONE || particle == psd.keep;
+				complete[row] = true;
+				range_active[k] = false;
+			}
+		}
+
+		if (tail != head && complete[tail]) {
+			if (kept[tail]) {
+				pulse_event<I> e;
+				for (int f = 0; f < RESULT_SIZE; f++)
+					e.res[f] = res[tail][f];
+				e.sample = at[tail];
+				e.end = false;
+				events.write(e);
+			}
+			complete[tail] = false;
+			++tail;
+		}
+	}
+
+	// The record tail covers every range, so the pulses left are complete
+drain_pulses:
+	while (tail != head) {
+#pragma HLS PIPELINE II=1
+		if (kept[tail]) {
+			pulse_event<I> e;
+			for (int f = 0; f < RESULT_SIZE; f++)
+				e.res[f] = res[tail][f];
+			e.sample = at[tail];
+			e.end = false;
+			events.write(e);
+		}
+		complete[tail] = false;
+		++tail;
 	}
+	pulse_event<I> e;
+	e.end = true;
+	events.write(e);
 }
 
-static void energies_calculation(float * rc_peak_signal, float * energies_buf)
+// The pulses of a record, MAX_PEAKS x RESULT_SIZE with NPEAKS the number of them and zeros after them
+template <class I>
+static void record_results(hls::stream<pulse_event<I> > & events, hls::stream<float> & results)
 {
-	float ampli = 0;
-	float emax = 0;
-	float energ_1 = 0;
-	float energ_2 = 0;
+	float res[MAX_PEAKS][RESULT_SIZE];
+#pragma HLS ARRAY_PARTITION variable=res dim=2 complete
+	short count = 0;
+	bool end = false;
 
-	// MAX VALUE
-	for(short i = 0; i < RANGE_TO; i++ ) {
-#pragma HLS unroll
-		ampli = rc_peak_signal[i];
-		emax = ampli < emax ? ampli : emax;
+collect_pulses:
+	while (!end) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = 1 max = MAX_PEAKS + 1
+		pulse_event<I> e = events.read();
+		end = e.end;
+		if (!end && count < MAX_PEAKS) {
+			for (int f = 0; f < RESULT_SIZE; f++)
+				res[count][f] = e.res[f];
+			++count;
+		}
+	}
+mem_record_result_wr:
+	for (short i = 0; i < MAX_PEAKS; ++i) {
+		for (short f = 0; f < RESULT_SIZE; ++f) {
+#pragma HLS PIPELINE II=1
+			results.write(i < count ? (f == NPEAKS ? (float)count : res[i][f]) : 0);
+		}
 	}
+}
 
-	// PROMPR CHARGE
-	for (short i = 30; i <= (RANGE_FROM + 20); i++) {
-#pragma HLS unroll
-		energ_1 += SLOPE*rc_peak_signal[i];
+template <class T, class P, class M, class AXIS>
+static void analyse_record(hls::stream<AXIS> &ln0, int lbaseline, hls::vector<typename T::coef_t,20> & h_vector, float h_sum, float factor, float threshold, hls::stream<float> & result, float scale, short size, int shaping, energy_windows & ewin, psd_cut & psd)
+{
+	typedef typename M::index_t I;
+	static const int N = input_beat<AXIS>::N;
+	hls::stream<trigger_token<N> > triggers("triggers");
+	hls::stream<baseline_token<N, I> > windows("windows");
+	hls::stream<shaped_token<T, N, I> > shaped("shaped");
+	hls::stream<cfd_token<T, N, I> > cfd("cfd");
+	hls::stream<pulse_token<N, I> > pulses("pulses");
+	hls::stream<pulse_event<I> > events("events");
+
+#pragma HLS dataflow
+
+	read_trigger<P, M>(ln0, triggers, lbaseline, threshold, size);
+
+	window_baseline<P, M, N>(triggers, windows);
+
+	shape_signal<T, M, N>(windows, shaped, h_vector, h_sum, shaping);
+
+	compute_cfd<T, P, M, N>(shaped, cfd, factor, scale);
+
+	zero_cross<T, P, M, N>(cfd, pulses, threshold);
+
+	energy_integration<T, P, M, N>(pulses, events, ewin, psd);
+
+	record_results(events, result);
+}
+
+/*
+ * The pulse events of the continuous stream go to a circular buffer of
+ * ring_size slots, with NPEAKS set to 1, and their samples to the same slot
+ * of sample. wr_ptr[0] counts the events written.
+ */
+static void store_events(hls::stream<pulse_event<continuous_input::index_t> > & events, float * result, unsigned long long * sample, int ring_size, volatile unsigned int * wr_ptr)
+{
+	unsigned int produced = 0;
+	int slot = 0;
+	bool end = false;
+
+store_pulses:
+	while (!end) {
+		pulse_event<continuous_input::index_t> e = events.read();
+		end = e.end;
+		if (!end) {
+mem_event_wr:
+			for (int f = 0; f < RESULT_SIZE; f++) {
+#pragma HLS PIPELINE II=1
+				result[slot*RESULT_SIZE + f] = f == NPEAKS ? 1.0f : e.res[f];
+			}
+			sample[slot] = e.sample;
+			wr_ptr[0] = ++produced;
+			slot = slot + 1 == ring_size ? 0 : slot + 1;
+		}
+	}
+}
+
+template <class T, class P, class AXIS>
+static void analyse_continuous(hls::stream<AXIS> &ln0, int lbaseline, hls::vector<typename T::coef_t,20> & h_vector, float h_sum, float factor, float threshold, float * result, unsigned long long * sample, float scale, int ring_size, volatile unsigned int * wr_ptr, long long samples, int shaping, energy_windows & ewin, psd_cut & psd)
+{
+	typedef continuous_input M;
+	typedef M::index_t I;
+	static const int N = input_beat<AXIS>::N;
+	hls::stream<trigger_token<N> > triggers("triggers");
+	hls::stream<baseline_token<N, I> > windows("windows");
+	hls::stream<shaped_token<T, N, I> > shaped("shaped");
+	hls::stream<cfd_token<T, N, I> > cfd("cfd");
+	hls::stream<pulse_token<N, I> > pulses("pulses");
+	hls::stream<pulse_event<I> > events("events");
+
+#pragma HLS dataflow
+
+	read_trigger<P, M>(ln0, triggers, lbaseline, threshold, samples);
+
+	window_baseline<P, M, N>(triggers, windows);
+
+	shape_signal<T, M, N>(windows, shaped, h_vector, h_sum, shaping);
+
+	compute_cfd<T, P, M, N>(shaped, cfd, factor, scale);
+
+	zero_cross<T, P, M, N>(cfd, pulses, threshold);
+
+	energy_integration<T, P, M, N>(pulses, events, ewin, psd);
+
+	store_events(events, result, sample, ring_size, wr_ptr);
+}
+
+static void store_results(hls::stream<float> & in, float * results)
+{
+mem_record_result_wr:
+	for (short i = 0; i < MAX_PEAKS*RESULT_SIZE; ++i) {
+#pragma HLS PIPELINE II=1
+		results[i] = in.read();
+	}
+}
+
+/*
+ * Batch lanes. A record keeps analyse_record busy for max(size, last trigger
+ * + RECORD_TAIL) samples, so with a single copy ln0 stops for the tail of every
+ * record with a late pulse. dispatch_records deals the records round-robin to
+ * DPSA_LANES copies of analyse_record and write_results stores their results
+ * in record order. Each lane is a full copy of the pipeline: two hide most of
+ * the tail of DATA_SIZE sample records and three all of it.
+ */
+#ifndef DPSA_LANES
+#define DPSA_LANES 2
+#endif
+#define LANE_DEPTH 64
+
+template <class AXIS>
+static void dispatch_records(hls::stream<AXIS> &ln0, int * waveform_args, hls::stream<AXIS> lane_in[DPSA_LANES], hls::stream<int> lane_baseline[DPSA_LANES], hls::stream<int> & offsets, short size, short nrecords)
+{
+	static const int N = input_beat<AXIS>::N;
+dispatch:
+	for (short r = 0; r < nrecords; r++) {
+#pragma HLS LOOP_TRIPCOUNT min = 1 max = MAX_BATCH
+		const int lane = r % DPSA_LANES;
+		int * args = waveform_args + ARGS_SIZE*r;
+		lane_baseline[lane].write(args[BS]);
+		offsets.write(args[OF]);
+read_waveform:
+		for (short i = 0; i < size/N; i++) {
+#pragma HLS PIPELINE II=1
+#pragma HLS LOOP_TRIPCOUNT min = DATA_SIZE/N max = DATA_SIZE/N
+			lane_in[lane].write(ln0.read());
+		}
+	}
+}
+
+template <class T, class P, class AXIS>
+static void run_lane(int lane, hls::stream<AXIS> & in, hls::stream<int> & baseline, hls::stream<float> & out, hls::vector<typename T::coef_t,20> & h_vector, float h_sum, float factor, float threshold, float scale, short size, short nrecords, int shaping, energy_windows & ewin, psd_cut & psd)
+{
+lane_records:
+	for (short r = lane; r < nrecords; r += DPSA_LANES) {
+#pragma HLS LOOP_TRIPCOUNT min = 1 max = MAX_BATCH/DPSA_LANES
+		analyse_record<T, P, batch_input>(in, baseline.read(), h_vector, h_sum, factor, threshold, out, scale, size, shaping, ewin, psd);
 	}
+}
 
-	// DELAY CHARGE
-	for (int i = RANGE_FROM + 20; i <= RANGE_TO; i++) {
+static void write_results(hls::stream<float> lane_out[DPSA_LANES], hls::stream<int> & offsets, float * result, short nrecords)
+{
+records:
+	for (short r = 0; r < nrecords; r++) {
+#pragma HLS LOOP_TRIPCOUNT min = 1 max = MAX_BATCH
+		store_results(lane_out[r % DPSA_LANES], result + r*MAX_PEAKS*RESULT_SIZE + RESULT_SIZE*offsets.read());
+	}
+}
+
+template <class T, class P, class AXIS>
+static void analyse_lanes(hls::stream<AXIS> &ln0, int * waveform_args, hls::vector<typename T::coef_t,20> & h_vector, float h_sum, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, energy_windows & ewin, psd_cut & psd)
+{
+	hls::stream<AXIS> lane_in[DPSA_LANES];
+	hls::stream<int> lane_baseline[DPSA_LANES];
+	hls::stream<float> lane_out[DPSA_LANES];
+	hls::stream<int> offsets("offsets");
+#pragma HLS STREAM variable=lane_in depth=LANE_DEPTH
+#pragma HLS STREAM variable=lane_baseline depth=MAX_BATCH
+#pragma HLS STREAM variable=lane_out depth=MAX_PEAKS*RESULT_SIZE
+#pragma HLS STREAM variable=offsets depth=MAX_BATCH
+
+#pragma HLS dataflow
+
+	dispatch_records(ln0, waveform_args, lane_in, lane_baseline, offsets, size, nrecords);
+
+lanes:
+	for (int lane = 0; lane < DPSA_LANES; lane++) {
 #pragma HLS unroll
-		energ_2 += SLOPE*rc_peak_signal[i];
+		run_lane<T, P>(lane, lane_in[lane], lane_baseline[lane], lane_out[lane], h_vector, h_sum, factor, threshold, scale, size, nrecords, shaping, ewin, psd);
 	}
 
-	energies_buf[0] = SLOPE*emax;
-	energies_buf[1] = energ_1 + energ_2;
-	energies_buf[2] = energ_1;
-	energies_buf[3] = energ_2;
+	write_results(lane_out, offsets, result, nrecords);
+}
 
+template <class T, class P, class AXIS>
+static void analyse_batch(hls::stream<AXIS> &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd)
+{
+    hls::vector<typename T::coef_t,20> h_vector;
+    float h_sum = 0;
+    energy_windows ewin;
+    psd_cut cut;
+
+    load_h_input<T>(h, h_vector, h_sum, FIR_N);
+    load_windows<P>(windows, ewin);
+    load_psd(psd, cut);
+
+    analyse_lanes<T, P>(ln0, waveform_args, h_vector, h_sum, factor, threshold, result, scale, size, nrecords, shaping, ewin, cut);
 }
 
-static void store_results(float* results, short * pileup, short npeaks, float * baseline, float * stdbaseline, float * time, float energies[MAX_PEAKS][4])
+/*
+ * Records framed by TLAST on ln0, each MAX_PEAKS x RESULT_SIZE block pushed
+ * into a circular buffer of ring_size slots. records = 0 runs forever.
+ */
+template <class T, class AXIS>
+static void stream_records(hls::stream<AXIS> &ln0, float * h, float factor, float threshold, int baseline, float * result, float scale, int ring_size, volatile unsigned int * wr_ptr, unsigned int records, int shaping, int * windows, float * psd)
 {
-mem_record_result_wr:
-	for(short i = 0; i < npeaks; ++i ){
-		results[PILEUP + RESULT_SIZE*i] = pileup[i];
-		results[SATURED + RESULT_SIZE*i] = 0;
-		results[NPEAKS + RESULT_SIZE*i] = npeaks;
-		results[BASELINE + RESULT_SIZE*i] = baseline[i];
-		results[STDBASELINE + RESULT_SIZE*i] = stdbaseline[i];
-		results[PTIME + RESULT_SIZE*i] = time[i];
-		results[MAX + RESULT_SIZE*i] = energies[i][0];
-		results[EN + RESULT_SIZE*i] = energies[i][1];
-		results[EN1 + RESULT_SIZE*i] = energies[i][2];
-		results[EN2 + RESULT_SIZE*i] = energies[i][3];
-	}
-	for(short i = npeaks; i < MAX_PEAKS; ++i ){
-		results[PILEUP + RESULT_SIZE*i] = 0;
-		results[SATURED + RESULT_SIZE*i] = 0;
-		results[NPEAKS + RESULT_SIZE*i] = 0;
-		results[BASELINE + RESULT_SIZE*i] = 0;
-		results[STDBASELINE + RESULT_SIZE*i] = 0;
-		results[PTIME + RESULT_SIZE*i] = 0;
-		results[MAX + RESULT_SIZE*i] = 0;
-		results[EN + RESULT_SIZE*i] = 0;
-		results[EN1 + RESULT_SIZE*i] = 0;
-		results[EN2 + RESULT_SIZE*i] = 0;
+    hls::vector<typename T::coef_t,20> h_vector;
+    float h_sum = 0;
+    energy_windows ewin;
+    psd_cut cut;
+    hls::stream<float> block("block");
+#pragma HLS STREAM variable=block depth=MAX_PEAKS*RESULT_SIZE
+    unsigned int produced = 0;
+    int slot = 0;
+
+    load_h_input<T>(h, h_vector, h_sum, FIR_N);
+    load_windows<dpsa_config>(windows, ewin);
+    load_psd(psd, cut);
+
+free_run:
+	while (records == 0 || produced < records) {
+		analyse_record<T, dpsa_config, framed_input>(ln0, baseline, h_vector, h_sum, factor, threshold, block, scale, DATA_SIZE, shaping, ewin, cut);
+		store_results(block, result + slot*MAX_PEAKS*RESULT_SIZE);
+		wr_ptr[0] = ++produced;
+		slot = slot + 1 == ring_size ? 0 : slot + 1;
 	}
 }
 
+template <class T, class AXIS>
+static void stream_samples(hls::stream<AXIS> &ln0, float * h, float factor, float threshold, int baseline, float * result, float scale, int ring_size, volatile unsigned int * wr_ptr, unsigned long long samples, int shaping, int * windows, float * psd, unsigned long long * sample)
+{
+    hls::vector<typename T::coef_t,20> h_vector;
+    float h_sum = 0;
+    energy_windows ewin;
+    psd_cut cut;
+
+    load_h_input<T>(h, h_vector, h_sum, FIR_N);
+    load_windows<dpsa_config>(windows, ewin);
+    load_psd(psd, cut);
+
+    analyse_continuous<T, dpsa_config>(ln0, baseline, h_vector, h_sum, factor, threshold, result, sample, scale, ring_size, wr_ptr, samples, shaping, ewin, cut);
+}
+
 extern "C" {
-void krnl_dpsa(hls::stream<ap_axis<16, 0, 0, 0> > &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size)
+/*
+ * nrecords records of size samples each arrive back to back on ln0. Record r takes
+ * its baseline and offset from waveform_args[ARGS_SIZE*r] and writes its
+ * MAX_PEAKS x RESULT_SIZE results to result[r*MAX_PEAKS*RESULT_SIZE].
+ * shaping selects the filter of shape_signal (RC_SHAPING, RC_IIR_SHAPING or RC4_SHAPING).
+ * windows holds ENERGIES x WINDOW_ARGS energy windows {method, from, to}, one
+ * per ENERGY result field, and psd the PSD_ARGS table of the PSD and PARTICLE
+ * fields. Every digitizer channel has its own compute unit, krnl_dpsa_<channel + 1>.
+ */
+void krnl_dpsa(hls::stream<ap_axis<16, 0, 0, 0> > &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd)
 {
 #pragma HLS INTERFACE m_axi port = result bundle = gmem0
 #pragma HLS INTERFACE m_axi port = waveform_args bundle = gmem2
 #pragma HLS INTERFACE m_axi port = h bundle = gmem1
+#pragma HLS INTERFACE m_axi port = windows bundle = gmem1
+#pragma HLS INTERFACE m_axi port = psd bundle = gmem1
 
-	float rc_vector[MAX_PEAKS][3*SIZE], cfd_vector[MAX_PEAKS][3*SIZE], rc_peak_signal[MAX_PEAKS][SIZE], l_float[MAX_PEAKS][3*SIZE];
-    hls::vector<float,20> h_vector;
-    float h_sum = 0;
-    int l_in[DATA_SIZE];
-    short npeaks = 0;
-    short pileup[MAX_PEAKS];
-    float time[MAX_PEAKS];
-    float energy[MAX_PEAKS][4];
-    int start_index[MAX_PEAKS];
-    float baseline_calculated[MAX_PEAKS], stdbaseline[MAX_PEAKS];
-    int lbaseline = waveform_args[BS], loffset = RESULT_SIZE*waveform_args[OF];
+	analyse_batch<dpsa_float, dpsa_config>(ln0, waveform_args, h, factor, threshold, result, scale, size, nrecords, shaping, windows, psd);
+	}
 
-#pragma HLS dataflow
+/*
+ * krnl_dpsa with the dpsa_fixed datapath. Arguments and results are the
+ * same, so the host can run either one.
+ */
+void krnl_dpsa_fixed(hls::stream<ap_axis<16, 0, 0, 0> > &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd)
+{
+#pragma HLS INTERFACE m_axi port = result bundle = gmem0
+#pragma HLS INTERFACE m_axi port = waveform_args bundle = gmem2
+#pragma HLS INTERFACE m_axi port = h bundle = gmem1
+#pragma HLS INTERFACE m_axi port = windows bundle = gmem1
+#pragma HLS INTERFACE m_axi port = psd bundle = gmem1
+
+	analyse_batch<dpsa_fixed, dpsa_config>(ln0, waveform_args, h, factor, threshold, result, scale, size, nrecords, shaping, windows, psd);
+	}
+
+/*
+ * krnl_dpsa_fixed on eight samples per cycle, enough for a 1 GS/s ADC at a
+ * 125 MHz PL clock. ln0 takes the 128-bit beats of krnl_JESD204B_tx without
+ * krnl_JESD204B_rx, first sample in the least significant bits, and size
+ * must be a multiple of 8. Arguments and results are those of krnl_dpsa.
+ * It only comes with the fixed point datapath: the float IIR shaping cannot
+ * take a beat per cycle.
+ */
+void krnl_dpsa_wide(hls::stream<uint128_t> &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd)
+{
+#pragma HLS INTERFACE m_axi port = result bundle = gmem0
+#pragma HLS INTERFACE m_axi port = waveform_args bundle = gmem2
+#pragma HLS INTERFACE m_axi port = h bundle = gmem1
+#pragma HLS INTERFACE m_axi port = windows bundle = gmem1
+#pragma HLS INTERFACE m_axi port = psd bundle = gmem1
 
-    load_h_input(h, h_vector, h_sum, FIR_N);
+	analyse_batch<dpsa_fixed, dpsa_config>(ln0, waveform_args, h, factor, threshold, result, scale, size, nrecords, shaping, windows, psd);
+	}
 
-    load_input(ln0, l_in, lbaseline, npeaks, start_index, threshold, size);
+/*
+ * Free-running variant, launched once. Records arrive on ln0 framed by TLAST and
+ * each MAX_PEAKS x RESULT_SIZE block is pushed into a circular buffer of ring_size
+ * slots. Once a slot is written, the number of records produced so far is
+ * published in wr_ptr[0] for the host to poll. records = 0 runs forever.
+ */
+void krnl_dpsa_stream(hls::stream<ap_axis<16, 1, 0, 0> > &ln0, float * h, float factor, float threshold, int baseline, float * result, float scale, int ring_size, volatile unsigned int * wr_ptr, unsigned int records, int shaping, int * windows, float * psd)
+{
+#pragma HLS INTERFACE m_axi port = result bundle = gmem0
+#pragma HLS INTERFACE m_axi port = wr_ptr bundle = gmem0
+#pragma HLS INTERFACE m_axi port = h bundle = gmem1
+#pragma HLS INTERFACE m_axi port = windows bundle = gmem1
+#pragma HLS INTERFACE m_axi port = psd bundle = gmem1
 
-	for(short i = 0; i < npeaks; i++){
-		int bs_end = start_index[i] +3*SIZE;
-		int pulse_start = start_index[i] + SIZE;
-		int pulse_end = start_index[i] + 2*SIZE;
+	stream_records<dpsa_float>(ln0, h, factor, threshold, baseline, result, scale, ring_size, wr_ptr, records, shaping, windows, psd);
+}
 
-		baseline_calc( baseline_calculated[i], stdbaseline[i], l_float[i], l_in, start_index[i], bs_end, pulse_start, pulse_end);
+/*
+ * krnl_dpsa_stream eight samples per cycle, from the 128-bit beats of
+ * krnl_JESD204B_rx_stream_wide. Fixed point datapath, as krnl_dpsa_wide.
+ */
+void krnl_dpsa_stream_wide(hls::stream<wide_axis> &ln0, float * h, float factor, float threshold, int baseline, float * result, float scale, int ring_size, volatile unsigned int * wr_ptr, unsigned int records, int shaping, int * windows, float * psd)
+{
+#pragma HLS INTERFACE m_axi port = result bundle = gmem0
+#pragma HLS INTERFACE m_axi port = wr_ptr bundle = gmem0
+#pragma HLS INTERFACE m_axi port = h bundle = gmem1
+#pragma HLS INTERFACE m_axi port = windows bundle = gmem1
+#pragma HLS INTERFACE m_axi port = psd bundle = gmem1
 
-		compute_rc_cfd(	l_float[i], h_vector, h_sum, rc_vector[i], cfd_vector[i], factor, scale);
+	stream_records<dpsa_fixed>(ln0, h, factor, threshold, baseline, result, scale, ring_size, wr_ptr, records, shaping, windows, psd);
+}
 
-		peak_detection(	pileup[i], time[i], rc_peak_signal[i], l_float[i], rc_vector[i], cfd_vector[i], start_index[i],threshold);
+/*
+ * Triggerless variant of krnl_dpsa_stream, launched once. ln0 is analysed as
+ * one stream and TLAST is ignored, so windows reach across the records of
+ * krnl_JESD204B_rx_stream and every pulse is analysed once, wherever it
+ * falls. Each pulse is written as it completes to a circular buffer of
+ * ring_size slots of RESULT_SIZE results, with NPEAKS set to 1, and the index
+ * of its sample in the stream to the same slot of sample; PTIME is the offset
+ * of the zero crossing from that sample. wr_ptr[0] counts the pulses written.
+ * samples = 0 runs forever.
+ */
+void krnl_dpsa_continuous(hls::stream<ap_axis<16, 1, 0, 0> > &ln0, float * h, float factor, float threshold, int baseline, float * result, float scale, int ring_size, volatile unsigned int * wr_ptr, unsigned long long samples, int shaping, int * windows, float * psd, unsigned long long * sample)
+{
+#pragma HLS INTERFACE m_axi port = result bundle = gmem0
+#pragma HLS INTERFACE m_axi port = sample bundle = gmem0
+#pragma HLS INTERFACE m_axi port = wr_ptr bundle = gmem0
+#pragma HLS INTERFACE m_axi port = h bundle = gmem1
+#pragma HLS INTERFACE m_axi port = windows bundle = gmem1
+#pragma HLS INTERFACE m_axi port = psd bundle = gmem1
 
-		energies_calculation( rc_peak_signal[i], energy[i]);
+	stream_samples<dpsa_float>(ln0, h, factor, threshold, baseline, result, scale, ring_size, wr_ptr, samples, shaping, windows, psd, sample);
+}
 
-	}
+/*
+ * krnl_dpsa_continuous eight samples per cycle, from the 128-bit beats of
+ * krnl_JESD204B_rx_stream_wide. Fixed point datapath, as krnl_dpsa_wide.
+ */
+void krnl_dpsa_continuous_wide(hls::stream<wide_axis> &ln0, float * h, float factor, float threshold, int baseline, float * result, float scale, int ring_size, volatile unsigned int * wr_ptr, unsigned long long samples, int shaping, int * windows, float * psd, unsigned long long * sample)
+{
+#pragma HLS INTERFACE m_axi port = result bundle = gmem0
+#pragma HLS INTERFACE m_axi port = sample bundle = gmem0
+#pragma HLS INTERFACE m_axi port = wr_ptr bundle = gmem0
+#pragma HLS INTERFACE m_axi port = h bundle = gmem1
+#pragma HLS INTERFACE m_axi port = windows bundle = gmem1
+#pragma HLS INTERFACE m_axi port = psd bundle = gmem1
 
-	store_results(result + loffset, pileup, npeaks, baseline_calculated, stdbaseline, time, energy);
-	}
+	stream_samples<dpsa_fixed>(ln0, h, factor, threshold, baseline, result, scale, ring_size, wr_ptr, samples, shaping, windows, psd, sample);
+}
 }
@@ -0,0 +1,231 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+/*
+ * Accuracy of the fixed point datapath (krnl_dpsa_fixed) against the float
+ * one (krnl_dpsa). Both kernels run in C simulation over the channel 0 records
+ * of the config.ini input file with its channel 0 analysis settings, and the
+ * baseline, time and energy deltas of the pulses found by both are reported in
+ * physical units.
+ *
+ *   g++ -O2 -I$XILINX_HLS/include -I../DPSA/src -o dpsa_accuracy dpsa_accuracy.cpp ../DPSA_kernels/src/krnl_dpsa.cpp \
+ *       ../DPSA/src/reader.cpp ../DPSA/src/record_index.cpp ../DPSA/src/SimpleDataProcess.cpp ../DPSA/src/parser.cpp
+ *   ./dpsa_accuracy config.ini [records]
+ *
+ * Other widths are evaluated by adding -DFIXED_SAMPLE_W=, -DFIXED_COEF_W= or
+ * -DFIXED_ACC_W= to the build line, and krnl_dpsa_wide in place of
+ * krnl_dpsa_fixed with -DDPSA_WIDE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <ap_axi_sdata.h>
+#include <hls_stream.h>
+
+#include "reader.h"
+#include "result_writer.h"
+#include "SimpleDataProcess.h"
+
+#define FIR_N 20
+#define SAMPLES 3000
+#define ARGS_SIZE 2
+#define CHANNEL 0
+#define BEAT_SAMPLES 8
+
+extern "C" {
+void krnl_dpsa(hls::stream<ap_axis<16, 0, 0, 0> > &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd);
+void krnl_dpsa_fixed(hls::stream<ap_axis<16, 0, 0, 0> > &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd);
+void krnl_dpsa_wide(hls::stream<ap_uint<128> > &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd);
+}
+
+typedef void (*dpsa_kernel)(hls::stream<ap_axis<16, 0, 0, 0> > &, int *, float *, float, float, float *, float, short, short, int, int *, float *);
+
+// Running statistics of the fixed - float deltas of one field
+struct delta_stats
+{
+	unsigned long long n;
+	double sum;
+	double sum2;
+	double max;
+	double rel_sum2;
+	unsigned long long rel_n;
+};
+
+static void add_delta(delta_stats &s, double ref, double value)
+{
+	// A flat CFD at the zero crossing leaves the time undefined in both
+	if (!isfinite(ref) || !isfinite(value))
+		return;
+	const double d = value - ref;
+	s.n++;
+	s.sum += d;
+	s.sum2 += d*d;
+	if (fabs(d) > s.max)
+		s.max = fabs(d);
+	if (ref != 0) {
+		s.rel_sum2 += (d/ref)*(d/ref);
+		s.rel_n++;
+	}
+}
+
+static void run_kernel(dpsa_kernel kernel, const int16_t *samples, int baseline, float *h, float factor, float threshold, float *result, float scale, int shaping, int *windows, float *psd)
+{
+	hls::stream<ap_axis<16, 0, 0, 0> > ln0;
+	for (int i = 0; i < SAMPLES; i++) {
+		ap_axis<16, 0, 0, 0> v;
+		v.data = samples[i];
+		ln0.write(v);
+	}
+	int args[ARGS_SIZE] = {baseline, 0};
+	kernel(ln0, args, h, factor, threshold, result, scale, SAMPLES, 1, shaping, windows, psd);
+}
+
+// krnl_dpsa_wide takes the samples as krnl_JESD204B_tx sends them, eight per beat
+static void run_wide(const int16_t *samples, int baseline, float *h, float factor, float threshold, float *result, float scale, int shaping, int *windows, float *psd)
+{
+	hls::stream<ap_uint<128> > ln0;
+	for (int i = 0; i < SAMPLES; i += BEAT_SAMPLES) {
+		ap_uint<128> v;
+		for (int k = 0; k < BEAT_SAMPLES; k++)
+			v.range(16*k + 15, 16*k) = (uint16_t)samples[i + k];
+		ln0.write(v);
+	}
+	int args[ARGS_SIZE] = {baseline, 0};
+	krnl_dpsa_wide(ln0, args, h, factor, threshold, result, scale, SAMPLES, 1, shaping, windows, psd);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <config.ini> [records]\n", argv[0]);
+		return 1;
+	}
+	const unsigned long long max_records = argc == 3 ? strtoull(argv[2], NULL, 10) : 0;
+
+	Simple_Data_Process sdp;
+	if (sdp.configure(argv[1]) != 0) {
+		fprintf(stderr, "ERROR: cannot configure from %s\n", argv[1]);
+		return 1;
+	}
+	const DPSA_Channel_Analysis_Struct CA = sdp.CA[CHANNEL];
+
+	MappedReader reader(sdp.input_file);
+	SP_Devices_DataBlock_Information card_header;
+	if (reader.ReadCardHeader(card_header) != NO_ERROR) {
+		fprintf(stderr, "ERROR: cannot read %s\n", sdp.input_file.c_str());
+		return 1;
+	}
+
+	// Same parameters as the host
+	const float FS = card_header.FullVerticalScale[CHANNEL]/65536;
+	const float SampleRate_1 = 1/(card_header.i64Frequency*1e-9);
+	const float scale = CA.detection.shaping.rc_scale;
+	const float factor = CA.detection.cfd.factor*scale;
+	const float threshold = (float)CA.detection.threshold / FS;
+	const int shaping = CA.detection.shaping.shaping_algorithm;
+	const float b = exp(-1/CA.detection.shaping.rc);
+	const float a = 1 - b;
+	float h[FIR_N] = {0};
+	if (shaping == RC_SHAPING) {
+		for (int i = 0; i < FIR_N; i++)
+			h[i] = a*pow(b, i);
+	} else {
+		h[0] = a;
+		h[1] = b;
+	}
+
+	int windows[MAX_ENERGY_CALCULATIONS*WINDOW_ARGS];
+	for (int j = 0; j < MAX_ENERGY_CALCULATIONS; j++) {
+		windows[j*WINDOW_ARGS + WINDOW_METHOD] = CA.energy[j].active ? CA.energy[j].calculation_method : NO_ENERGY;
+		windows[j*WINDOW_ARGS + WINDOW_FROM] = CA.energy[j].range_from;
+		windows[j*WINDOW_ARGS + WINDOW_TO] = CA.energy[j].range_to;
+	}
+	float psd[PSD_ARGS] = {0};
+	psd[PSD_TAIL] = CA.psd.active ? CA.psd.tail : NO_ENERGY;
+	psd[PSD_TOTAL] = CA.psd.active ? CA.psd.total : NO_ENERGY;
+	// Every pulse is kept, so both kernels report the same ones
+	psd[PSD_KEEP] = PARTICLE_NONE;
+	psd[PSD_POINTS] = CA.psd.points;
+	for (int k = 0; k < CA.psd.points; k++) {
+		psd[PSD_CUT_ENERGY + k] = CA.psd.cut_energy[k] / FS;
+		psd[PSD_CUT_RATIO + k] = CA.psd.cut_ratio[k];
+	}
+
+	// Physical unit of every compared field
+	int fields[RESULT_FIELDS] = {BASELINE, STDBASELINE, PTIME};
+	const char *names[RESULT_FIELDS] = {"baseline", "stdbaseline", "time"};
+	const char *units[RESULT_FIELDS] = {"mV", "mV", "ns"};
+	float mul[RESULT_FIELDS] = {FS, FS, SampleRate_1};
+	int nfields = 3;
+	const char *energy_names[MAX_ENERGY_CALCULATIONS] = {"energy0", "energy1", "energy2", "energy3", "energy4"};
+	for (int j = 0; j < MAX_ENERGY_CALCULATIONS; j++) {
+		if (!CA.energy[j].active)
+			continue;
+		fields[nfields] = ENERGY + j;
+		names[nfields] = energy_names[j];
+		units[nfields] = CA.energy[j].calculation_method == AREA ? "mV*smp" : "mV";
+		mul[nfields] = FS;
+		nfields++;
+	}
+	if (CA.psd.active) {
+		fields[nfields] = PSD;
+		names[nfields] = "psd";
+		units[nfields] = "-";
+		mul[nfields] = 1;
+		nfields++;
+	}
+	std::vector<delta_stats> stats(nfields, delta_stats());
+
+	std::vector<int16_t> samples(SAMPLES);
+	float ref[RESULT_MAX_PEAKS*RESULT_FIELDS], fixed[RESULT_MAX_PEAKS*RESULT_FIELDS];
+	unsigned long long records = 0, pulses = 0, npeaks_mismatch = 0, pileup_mismatch = 0, particle_mismatch = 0;
+	record_view record;
+
+	while ((max_records == 0 || records < max_records) && reader.NextRecord(record, samples.data(), SAMPLES) == NO_ERROR) {
+		if (record.header->channel != CHANNEL)
+			continue;
+		records++;
+		const int baseline = record.header->moving_average;
+		run_kernel(krnl_dpsa, samples.data(), baseline, h, factor, threshold, ref, scale, shaping, windows, psd);
+#ifdef DPSA_WIDE
+		run_wide(samples.data(), baseline, h, factor, threshold, fixed, scale, shaping, windows, psd);
+#else
+		run_kernel(krnl_dpsa_fixed, samples.data(), baseline, h, factor, threshold, fixed, scale, shaping, windows, psd);
+#endif
+
+		const int npeaks = ref[NPEAKS];
+		if (npeaks != (int)fixed[NPEAKS]) {
+			npeaks_mismatch++;
+			continue;
+		}
+		for (int peak = 0; peak < npeaks; peak++) {
+			const float *r = ref + peak*RESULT_FIELDS;
+			const float *f = fixed + peak*RESULT_FIELDS;
+			pulses++;
+			if (r[PILEUP] != f[PILEUP])
+				pileup_mismatch++;
+			if (r[PARTICLE] != f[PARTICLE])
+				particle_mismatch++;
+			for (int i = 0; i < nfields; i++)
+				add_delta(stats[i], r[fields[i]]*mul[i], f[fields[i]]*mul[i]);
+		}
+	}
+
+	printf("Input: %s, %llu records, %llu pulses\n", sdp.input_file.c_str(), records, pulses);
+	printf("Records with a different number of pulses: %llu\n", npeaks_mismatch);
+	printf("Pulses with a different pileup flag: %llu\n", pileup_mismatch);
+	printf("Pulses with a different particle: %llu\n", particle_mismatch);
+	printf("%-12s %-8s %12s %12s %12s %12s\n", "field", "unit", "mean", "rms", "max|d|", "rel rms");
+	for (int i = 0; i < nfields; i++) {
+		const delta_stats &s = stats[i];
+		const double n = s.n ? s.n : 1;
+		const double rel = s.rel_n ? sqrt(s.rel_sum2/s.rel_n) : 0;
+		printf("%-12s %-8s %12g %12g %12g %12g\n", names[i], units[i], s.sum/n, sqrt(s.sum2/n), s.max, rel);
+	}
+	return 0;
+}
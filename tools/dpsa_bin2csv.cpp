@@ -0,0 +1,87 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+/*
+ * Regenerates the CSV written by the host (Output format=CSV) from a binary
+ * result file (Output format=BINARY).
+ *
+ *   g++ -O2 -I../DPSA/src -o dpsa_bin2csv dpsa_bin2csv.cpp
+ *   ./dpsa_bin2csv out.bin > out.csv
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "result_writer.h"
+
+static void print_field(FILE *out, float value)
+{
+	// Same text as std::cout << float with the default precision
+	fprintf(out, "%g,", value);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <results.bin> [out.csv]\n", argv[0]);
+		return 1;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (!in) {
+		fprintf(stderr, "ERROR: cannot open %s\n", argv[1]);
+		return 1;
+	}
+	FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "ERROR: cannot open %s\n", argv[2]);
+		return 1;
+	}
+
+	result_file_header header;
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) ||
+			header.version != RESULT_VERSION || header.header_size != sizeof(header) ||
+			header.record_size != sizeof(result_record) || header.signal_size != sizeof(result_signal)) {
+		fprintf(stderr, "ERROR: %s is not a DPSA result file of this version\n", argv[1]);
+		return 1;
+	}
+
+	fprintf(stderr, "Input: %s, channel %u, %u samples, FS %g, offset %g, threshold %g\n",
+			header.input_file, header.channel, header.nsamples, header.units.FS, header.units.offset, header.threshold);
+
+	result_record record;
+	result_signal signal;
+	unsigned long long nrecords = 0;
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		fprintf(out, "%u,", record.nrecord);
+		if (header.continuous)
+			fprintf(out, "%lld,", record.timestamp);
+		for (unsigned int s = 0; s < record.nsignals; s++) {
+			if (fread(&signal, sizeof(signal), 1, in) != 1) {
+				fprintf(stderr, "ERROR: truncated record %u\n", record.nrecord);
+				return 1;
+			}
+			print_field(out, signal.pileup);
+			print_field(out, signal.saturated);
+			print_field(out, signal.nsignal);
+			print_field(out, signal.baseline);
+			print_field(out, signal.stdbaseline);
+			print_field(out, signal.time);
+			for (int i = ENERGY; i < PSD; i++)
+				print_field(out, signal.energy[i - ENERGY]);
+			print_field(out, signal.psd);
+			print_field(out, signal.particle);
+			fprintf(out, "%lld,", signal.event_time);
+		}
+		fprintf(out, "\n");
+		nrecords++;
+	}
+	fprintf(stderr, "%llu records\n", nrecords);
+
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
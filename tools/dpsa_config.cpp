@@ -0,0 +1,113 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+/*
+ * Writes the dpsa_config.h that specialises krnl_dpsa and the CPU engine for
+ * the analysis settings of one config.ini channel. krnl_dpsa.cpp and
+ * cpu_engine.cpp include it when built with -DDPSA_CONFIG.
+ *
+ *   g++ -O2 -I../DPSA/src -o dpsa_config dpsa_config.cpp ../DPSA/src/SimpleDataProcess.cpp ../DPSA/src/parser.cpp
+ *   ./dpsa_config config.ini [channel] > dpsa_config.h
+ *
+ * The energy range of a pulse starts "signal from" samples around the zero
+ * crossing and, as in the kernel, spans "signal to" samples. The energy
+ * windows are not part of it: the host passes them to the kernels at run time.
+ *
+ * Every channel compute unit is built from the same krnl_dpsa, so without a
+ * channel the settings of all active channels must agree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SimpleDataProcess.h"
+
+// Baseline regions of the window, not in config.ini
+#define SIZE 350
+#define PARAMS 7
+
+// dpsa_params of one channel, false if the kernel cannot take them
+static bool channel_params(const DPSA_Channel_Analysis_Struct &CA, int channel, int *params)
+{
+	const int range_from = -CA.detection.signal_from;
+	const int range_to = CA.detection.signal_to;
+	const int delay = CA.detection.cfd.delay;
+	if (range_from < 0 || range_from >= SIZE || range_to <= 0) {
+		fprintf(stderr, "ERROR: channel%d signal range must hold the zero crossing and start less than %d samples before it\n", channel, SIZE);
+		return false;
+	}
+	// As dpsa_params: the energy_integration ranges of pulses two apart must not overlap
+	if (range_to > 3*SIZE - 3) {
+		fprintf(stderr, "ERROR: channel%d signal to must be at most %d samples\n", channel, 3*SIZE - 3);
+		return false;
+	}
+	if (delay < 1 || delay > SIZE) {
+		fprintf(stderr, "ERROR: channel%d cfd delay must be in [1, %d]\n", channel, SIZE);
+		return false;
+	}
+	params[0] = SIZE;
+	params[1] = range_from;
+	params[2] = range_to;
+	params[3] = delay;
+	params[4] = CA.slope ? 1 : -1;
+	params[5] = CA.detection.cfd_method ? 1 : 0;
+	params[6] = CA.reject_saturated ? 1 : 0;
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <config.ini> [channel]\n", argv[0]);
+		return 1;
+	}
+	int channel = argc == 3 ? atoi(argv[2]) : -1;
+	if (argc == 3 && (channel < 0 || channel >= MAX_SP_CHANNELS)) {
+		fprintf(stderr, "ERROR: wrong channel %d\n", channel);
+		return 1;
+	}
+
+	Simple_Data_Process sdp;
+	if (sdp.configure(argv[1]) != 0) {
+		fprintf(stderr, "ERROR: cannot configure from %s\n", argv[1]);
+		return 1;
+	}
+	int params[PARAMS];
+	if (channel >= 0) {
+		if (!sdp.CA[channel].active) {
+			fprintf(stderr, "ERROR: channel%d is not active\n", channel);
+			return 1;
+		}
+		if (!channel_params(sdp.CA[channel], channel, params))
+			return 1;
+	} else {
+		for (int i = 0; i < MAX_SP_CHANNELS; i++) {
+			int p[PARAMS];
+			if (!sdp.CA[i].active)
+				continue;
+			if (!channel_params(sdp.CA[i], i, p))
+				return 1;
+			if (channel < 0) {
+				channel = i;
+				memcpy(params, p, sizeof(params));
+			} else if (memcmp(params, p, sizeof(params)) != 0) {
+				fprintf(stderr, "ERROR: channel%d and channel%d need different kernels, but their compute units share one\n", channel, i);
+				return 1;
+			}
+		}
+		if (channel < 0) {
+			fprintf(stderr, "ERROR: no active channel\n");
+			return 1;
+		}
+	}
+
+	printf("/*\n * Generated by dpsa_config from %s, channel%d. Do not edit.\n */\n\n", argv[1], channel);
+	printf("#ifndef DPSA_CONFIG_H_\n#define DPSA_CONFIG_H_\n\n");
+	printf("// SIZE, RANGE_FROM, RANGE_TO, DELAY, SLOPE, SPLINE, REJECT\n");
+	printf("#define DPSA_PARAMS %d, %d, %d, %d, %d, %d, %d\n\n", params[0], params[1], params[2], params[3], params[4], params[5], params[6]);
+	printf("#endif /* DPSA_CONFIG_H_ */\n");
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Hardware Acceleration of Digital Pulse Shape Analysis Using FPGAs © 2024 by César González, Mariano Ruiz, Antonio Carpeño, Alejandro Piñas, Daniel Cano-Ott, Julio Plaza, Trino Martinez and David Villamarin is licensed under Creative Commons Attribution 4.0 International.
+ * To view a copy of this license, visit https://creativecommons.org/licenses/by/4.0/
+ */
+
+/*
+ * Parity of the CPU engine (CpuEngine) with krnl_dpsa. Both run over the same
+ * seeded synthetic records, the kernel in C simulation, for every shaping
+ * mode the host offers: RC, RC4 and RC_IIR. The records hold noise around a
+ * random baseline and pulses of random height, shape and spacing, piled up
+ * and clipped at times. Every field of every pulse must match bit for bit;
+ * the first mismatches are printed and the exit status is 1.
+ *
+ *   g++ -O2 -ffp-contract=off -I$XILINX_HLS/include -I../DPSA/src -o dpsa_parity dpsa_parity.cpp \
+ *       ../DPSA_kernels/src/krnl_dpsa.cpp ../DPSA/src/cpu_engine.cpp
+ *   ./dpsa_parity [records] [seed]
+ *
+ * Add -mavx2 to check the vectorised engine, and -DDPSA_CONFIG -I<dir> to check
+ * the build of a dpsa_config.h. Fused multiply-adds round differently from the
+ * kernel C simulation, hence -ffp-contract=off.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <vector>
+
+#include <ap_axi_sdata.h>
+#include <hls_stream.h>
+
+#include "cpu_engine.h"
+#include "SimpleDataProcess.h"
+
+#ifdef DPSA_CONFIG
+#include "dpsa_config.h"
+#else
+#define DPSA_PARAMS 350, 50, 300, 10, -1, 1, 0
+#endif
+
+#define SAMPLES 3000
+#define ARGS_SIZE 2
+#define MAX_PULSES 5
+#define MAX_REPORTED 10
+
+extern "C" {
+void krnl_dpsa(hls::stream<ap_axis<16, 0, 0, 0> > &ln0, int * waveform_args, float * h, float factor, float threshold, float * result, float scale, short size, short nrecords, int shaping, int * windows, float * psd);
+}
+
+// The pulse polarity and window length the kernels are built for
+template <int SIZE, int RANGE_FROM, int RANGE_TO, int DELAY, int SLOPE_, int SPLINE, int REJECT>
+struct synthetic_params
+{
+	static constexpr int WINDOW = 3*SIZE;
+	static constexpr int SLOPE = SLOPE_;
+};
+typedef synthetic_params<DPSA_PARAMS> params;
+
+// Uniform in [lo, hi), from the raw generator output so that a seed gives the same records everywhere
+static double uniform(std::mt19937 &rng, double lo, double hi)
+{
+	return lo + (hi - lo)*(rng()/4294967296.0);
+}
+
+// Noise around the baseline and up to MAX_PULSES double exponential pulses, some closer than a window
+static int synthetic_record(std::mt19937 &rng, int16_t *samples)
+{
+	const int baseline = (int)uniform(rng, -2000, 2000);
+	const double noise = uniform(rng, 1, 30);
+	std::vector<double> x(SAMPLES, baseline);
+	const int pulses = (int)uniform(rng, 0, MAX_PULSES + 1);
+	int at = (int)uniform(rng, 0, params::WINDOW);
+	for (int p = 0; p < pulses && at < SAMPLES; p++) {
+		const double height = uniform(rng, 0, 1) < 0.1 ? uniform(rng, 30000, 60000) : uniform(rng, 300, 20000);
+		const double rise = uniform(rng, 1, 8);
+		const double decay = uniform(rng, 10, 120);
+		for (int i = at; i < SAMPLES; i++)
+			x[i] += params::SLOPE*height*(exp(-(i - at)/decay) - exp(-(i - at)/rise));
+		at += uniform(rng, 0, 1) < 0.3 ? (int)uniform(rng, 5, params::WINDOW) : (int)uniform(rng, params::WINDOW, 2*params::WINDOW);
+	}
+	for (int i = 0; i < SAMPLES; i++) {
+		const double v = round(x[i] + uniform(rng, -noise, noise));
+		samples[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t)v;
+	}
+	return baseline;
+}
+
+static void run_kernel(const int16_t *samples, int baseline, const channel_args &a, float *result)
+{
+	hls::stream<ap_axis<16, 0, 0, 0> > ln0;
+	for (int i = 0; i < SAMPLES; i++) {
+		ap_axis<16, 0, 0, 0> v;
+		v.data = samples[i];
+		ln0.write(v);
+	}
+	int args[ARGS_SIZE] = {baseline, 0};
+	channel_args k = a;
+	krnl_dpsa(ln0, args, k.h, k.factor, k.threshold, result, k.scale, SAMPLES, 1, k.shaping, k.windows, k.psd);
+}
+
+// Kernel arguments of a channel with the given shaping, as the host computes them
+static channel_args shaping_args(int shaping)
+{
+	channel_args a;
+	memset(&a, 0, sizeof(a));
+	const float rc = 6;
+	const float b = exp(-1/rc);
+	const float c = 1 - b;
+	if (shaping == RC_SHAPING) {
+		for (int i = 0; i < CPU_FIR_N; i++)
+			a.h[i] = c*pow(b, i);
+	} else {
+		a.h[0] = c;
+		a.h[1] = b;
+	}
+	a.scale = 1.64;
+	a.factor = 0.3*a.scale;
+	a.threshold = params::SLOPE*200;
+	a.shaping = shaping;
+
+	// One window of every method, some past the ends of the energy range so that they are clamped
+	const int windows[MAX_ENERGY_CALCULATIONS][WINDOW_ARGS] = {
+		{MAX_AMPLITUDE, -50, 300}, {AREA, -20, 300}, {AREA, -20, 20}, {RMS, 20, 300}, {PEAK2PEAK, -60, 400}};
+	memcpy(a.windows, windows, sizeof(windows));
+	a.psd[PSD_TAIL] = 2;
+	a.psd[PSD_TOTAL] = 1;
+	a.psd[PSD_KEEP] = PARTICLE_NONE;
+	a.psd[PSD_POINTS] = 2;
+	a.psd[PSD_CUT_ENERGY] = 0;
+	a.psd[PSD_CUT_ENERGY + 1] = 3000;
+	a.psd[PSD_CUT_RATIO] = 0.1;
+	a.psd[PSD_CUT_RATIO + 1] = 0.2;
+	return a;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [records] [seed]\n", argv[0]);
+		return 1;
+	}
+	const unsigned long records = argc >= 2 ? strtoul(argv[1], NULL, 10) : 200;
+	const unsigned long seed = argc == 3 ? strtoul(argv[2], NULL, 10) : 1;
+
+	const int modes[] = {RC_SHAPING, RC4_SHAPING, RC_IIR_SHAPING};
+	const char *names[] = {"RC", "RC4", "RC_IIR"};
+	std::vector<int16_t> samples(SAMPLES);
+	float kernel[RESULT_MAX_PEAKS*RESULT_FIELDS], cpu[RESULT_MAX_PEAKS*RESULT_FIELDS];
+	unsigned long long mismatches = 0;
+
+	for (int m = 0; m < 3; m++) {
+		const channel_args a = shaping_args(modes[m]);
+		CpuEngine engine(a);
+		std::mt19937 rng(seed);
+		unsigned long long pulses = 0, failed = 0;
+		for (unsigned long r = 0; r < records; r++) {
+			const int baseline = synthetic_record(rng, samples.data());
+			memset(kernel, 0, sizeof(kernel));
+			memset(cpu, 0, sizeof(cpu));
+			run_kernel(samples.data(), baseline, a, kernel);
+			engine.Analyse(samples.data(), SAMPLES, baseline, cpu);
+
+			const int npeaks = kernel[NPEAKS];
+			if (npeaks != (int)cpu[NPEAKS]) {
+				if (mismatches++ < MAX_REPORTED)
+					printf("%s record %lu: %d pulses, CPU %d\n", names[m], r, npeaks, (int)cpu[NPEAKS]);
+				failed++;
+				continue;
+			}
+			pulses += npeaks;
+			for (int peak = 0; peak < npeaks; peak++) {
+				const float *k = kernel + peak*RESULT_FIELDS;
+				const float *c = cpu + peak*RESULT_FIELDS;
+				if (memcmp(k, c, RESULT_FIELDS*sizeof(float)) == 0)
+					continue;
+				failed++;
+				for (int f = 0; f < RESULT_FIELDS; f++)
+					if (memcmp(k + f, c + f, sizeof(float)) != 0 && mismatches++ < MAX_REPORTED)
+						printf("%s record %lu pulse %d field %d: %.9g, CPU %.9g\n", names[m], r, peak, f, k[f], c[f]);
+			}
+		}
+		printf("%-8s %lu records, %llu pulses, %llu mismatches\n", names[m], records, pulses, failed);
+	}
+	printf("CPU engine: %s\n", CpuEngine::Isa());
+	return mismatches ? 1 : 0;
+}